@@ -1,39 +1,362 @@
 #ifdef _WIN32
+#define NOMINMAX
 #include <windows.h>
 #else
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <bitset>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <optional>
+#include <random>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
-using screen = std::array<std::array<int, 300>, 300>;
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CLON_SSE2 1
+#endif
+
+#ifdef __linux__
+#define CLON_SPLICE 1
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define CLON_URING 1
+#endif
+#if __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define CLON_PERF 1
+#endif
+#endif
+
+#ifdef CLON_TRACE
+// Scoped trace zones for a timeline of individual frames. Each thread keeps
+// its most recent zones in a ring of its own, written without locks, and
+// writeTrace exports them as Chrome trace JSON for chrome://tracing or
+// ui.perfetto.dev. Without CLON_TRACE the macros compile to nothing.
+struct TraceEvent
+{
+    const char* name;
+    std::int64_t begin; // ns since traceEpoch
+    std::int64_t end;
+    std::int64_t arg;   // shown as args.n; -1 for none
+};
+
+struct TraceBuffer
+{
+    static constexpr std::uint64_t capacity = 1 << 15;
+
+    TraceBuffer* next = nullptr;
+    int tid = 0;
+    std::atomic<const char*> name{nullptr};
+    std::atomic<std::uint64_t> written{0};
+    TraceEvent events[capacity];
+
+    // Only the owning thread pushes; once the ring is full the oldest zone
+    // is overwritten.
+    void push(const TraceEvent& e)
+    {
+        std::uint64_t n = written.load(std::memory_order_relaxed);
+        events[n & (capacity - 1)] = e;
+        written.store(n + 1, std::memory_order_release);
+    }
+};
+
+std::atomic<bool> traceEnabled{false};
+std::atomic<bool> traceDumpRequested{false};
+std::atomic<TraceBuffer*> traceBuffers{nullptr};
+std::atomic<int> traceThreads{0};
+const auto traceEpoch = std::chrono::steady_clock::now();
+
+inline std::int64_t traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// Buffers are never freed, so zones of a thread that has exited still make
+// it into the export.
+inline TraceBuffer& traceBuffer()
+{
+    thread_local TraceBuffer* buffer = []
+    {
+        auto* b = new TraceBuffer;
+        b->tid = ++traceThreads;
+        b->next = traceBuffers.load(std::memory_order_relaxed);
+        while (!traceBuffers.compare_exchange_weak(b->next, b, std::memory_order_release))
+        {
+        }
+        return b;
+    }();
+    return *buffer;
+}
+
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* zone, std::int64_t n = -1)
+        : name(traceEnabled.load(std::memory_order_relaxed) ? zone : nullptr),
+          arg(n),
+          begin(name ? traceNow() : 0)
+    {
+    }
+
+    ~TraceZone()
+    {
+        if (name)
+            traceBuffer().push({name, begin, traceNow(), arg});
+    }
+
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+
+private:
+    const char* name;
+    std::int64_t arg;
+    std::int64_t begin;
+};
+
+// Writes every thread's buffered zones as a Chrome trace. Safe to call while
+// other threads keep tracing: zones they overwrite during the copy are left
+// out rather than written torn.
+inline bool writeTrace(const char* path)
+{
+    FILE* f = std::fopen(path, "w");
+    if (!f)
+        return false;
+
+    std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+    const char* sep = "";
+    std::vector<TraceEvent> copy;
+    for (TraceBuffer* b = traceBuffers.load(std::memory_order_acquire); b; b = b->next)
+    {
+        if (const char* name = b->name.load(std::memory_order_relaxed))
+        {
+            std::fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,"
+                         "\"args\":{\"name\":\"%s\"}}", sep, b->tid, name);
+            sep = ",\n";
+        }
+
+        std::uint64_t end = b->written.load(std::memory_order_acquire);
+        std::uint64_t from = end > TraceBuffer::capacity ? end - TraceBuffer::capacity : 0;
+        copy.clear();
+        for (std::uint64_t i = from; i < end; ++i)
+            copy.push_back(b->events[i & (TraceBuffer::capacity - 1)]);
+        // The thread may be partway through pushing zone `now`, over slot
+        // now - capacity, so that one is skipped too. The fence keeps the
+        // copy above from being read after `written` is.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        std::uint64_t now = b->written.load(std::memory_order_relaxed);
+        std::uint64_t valid = now + 1 > TraceBuffer::capacity ? now + 1 - TraceBuffer::capacity : 0;
+
+        for (std::uint64_t i = std::max(from, valid); i < end; ++i)
+        {
+            const TraceEvent& e = copy[i - from];
+            std::fprintf(f, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,"
+                         "\"ts\":%.3f,\"dur\":%.3f", sep, e.name, b->tid,
+                         e.begin / 1e3, (e.end - e.begin) / 1e3);
+            if (e.arg >= 0)
+                std::fprintf(f, ",\"args\":{\"n\":%lld}", (long long)e.arg);
+            std::fputc('}', f);
+            sep = ",\n";
+        }
+    }
+    std::fputs("\n]}\n", f);
+    return std::fclose(f) == 0;
+}
+
+#define CLON_CONCAT_(a, b) a##b
+#define CLON_CONCAT(a, b) CLON_CONCAT_(a, b)
+// CLON_ZONE("name") or CLON_ZONE("name", n) traces the rest of the scope.
+#define CLON_ZONE(...) TraceZone CLON_CONCAT(traceZone, __LINE__)(__VA_ARGS__)
+#define CLON_THREAD_NAME(n) traceBuffer().name.store(n, std::memory_order_relaxed)
+#else
+#define CLON_ZONE(...)
+#define CLON_THREAD_NAME(n)
+#endif
+
+constexpr int screenW = 300;
+constexpr int screenH = 300;
+
+// Pixels are packed as 0xAARRGGBB so spans can be copied and blended a whole
+// register at a time.
+using Pixel = std::uint32_t;
+using screen = std::array<std::array<Pixel, screenW>, screenH>;
 
 struct Color
 {
-    unsigned char r, g, b;
+    unsigned char r, g, b, a = 255;
+};
+
+constexpr Pixel compactColor(Color c)
+{
+    return Pixel(c.a) << 24 | Pixel(c.r) << 16 | Pixel(c.g) << 8 | Pixel(c.b);
+}
+
+inline void unpackColor(Pixel packed, int& r, int& g, int& b)
+{
+    r = (packed >> 16) & 0xFF;
+    g = (packed >> 8) & 0xFF;
+    b = packed & 0xFF;
+}
+
+struct Rect
+{
+    int x, y, w, h;
 };
 
-int compactColor(Color c)
+class Surface
 {
-    return c.r * 1000000 + c.g * 1000 + c.b;
+public:
+    Surface() = default;
+
+    Surface(int width, int height, Color fill = {0, 0, 0, 0})
+        : w(width), h(height), pixels(size_t(width) * height, compactColor(fill))
+    {
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    Pixel* row(int y) { return pixels.data() + size_t(y) * w; }
+    const Pixel* row(int y) const { return pixels.data() + size_t(y) * w; }
+
+    void setPixel(int x, int y, Color c)
+    {
+        if (x < 0 || y < 0 || x >= w || y >= h)
+            return;
+        row(y)[x] = compactColor(c);
+    }
+
+    Pixel getPixel(int x, int y) const
+    {
+        if (x < 0 || y < 0 || x >= w || y >= h)
+            return 0;
+        return row(y)[x];
+    }
+
+private:
+    int w = 0;
+    int h = 0;
+    std::vector<Pixel> pixels;
+};
+
+using Sprite = Surface;
+
+// Clips srcRect against the source and the destination once, so the span
+// kernels below never have to bounds check a pixel.
+inline bool clipBlit(Rect& src, int& dstX, int& dstY, int srcW, int srcH, int dstW, int dstH)
+{
+    if (src.x < 0) { dstX -= src.x; src.w += src.x; src.x = 0; }
+    if (src.y < 0) { dstY -= src.y; src.h += src.y; src.y = 0; }
+    if (dstX < 0) { src.x -= dstX; src.w += dstX; dstX = 0; }
+    if (dstY < 0) { src.y -= dstY; src.h += dstY; dstY = 0; }
+
+    src.w = std::min({src.w, srcW - src.x, dstW - dstX});
+    src.h = std::min({src.h, srcH - src.y, dstH - dstY});
+    return src.w > 0 && src.h > 0;
+}
+
+inline void copySpan(Pixel* dst, const Pixel* src, int n)
+{
+    std::memcpy(dst, src, size_t(n) * sizeof(Pixel));
+}
+
+// Copies every pixel whose rgb differs from key; alpha is ignored.
+inline void keySpan(Pixel* dst, const Pixel* src, int n, Pixel key)
+{
+    key &= 0x00FFFFFF;
+    int i = 0;
+#ifdef CLON_SSE2
+    const __m128i rgbMask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i keyV = _mm_set1_epi32(int(key));
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(s, rgbMask), keyV);
+        __m128i out = _mm_or_si128(_mm_and_si128(hit, d), _mm_andnot_si128(hit, s));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        if ((src[i] & 0x00FFFFFF) != key)
+            dst[i] = src[i];
+    }
 }
 
-inline void unpackColor(int packed, int& r, int& g, int& b)
+// Blends straight-alpha src over an opaque dst: d = (s * a + d * (255 - a)) / 255.
+inline void alphaSpan(Pixel* dst, const Pixel* src, int n)
 {
-    r = packed / 1000000;
-    g = (packed / 1000) % 1000;
-    b = packed % 1000;
+    int i = 0;
+#ifdef CLON_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i opaque = _mm_set1_epi32(int(0xFF000000));
+
+    auto blend2 = [&](__m128i s, __m128i d)
+    {
+        __m128i a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+        a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a),
+                                  _mm_mullo_epi16(d, _mm_sub_epi16(full, a)));
+        t = _mm_add_epi16(t, round);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i lo = blend2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = blend2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_or_si128(_mm_packus_epi16(lo, hi), opaque));
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        Pixel s = src[i];
+        Pixel d = dst[i];
+        Pixel a = s >> 24;
+        Pixel out = 0xFF000000;
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            Pixel t = ((s >> shift) & 0xFF) * a + ((d >> shift) & 0xFF) * (255 - a) + 128;
+            out |= ((t + (t >> 8)) >> 8) << shift;
+        }
+        dst[i] = out;
+    }
 }
 
 enum class KeyType
@@ -47,10 +370,188 @@ enum class KeyType
     Right,
     Backspace,
     Tab,
+    Home,
+    End,
+    PageUp,
+    PageDown,
+    Insert,
+    Delete,
+    F1,
+    F2,
+    F3,
+    F4,
+    F5,
+    F6,
+    F7,
+    F8,
+    F9,
+    F10,
+    F11,
+    F12,
+    Shift,
+    Ctrl,
+    Alt,
     Unknown
 };
 
-using KeyEvent = std::variant<char, KeyType>;
+// Modifier bits, as the terminal reports them.
+enum KeyMod : std::uint8_t
+{
+    ModShift = 1,
+    ModAlt = 2,
+    ModCtrl = 4,
+    ModSuper = 8,
+};
+
+enum class KeyAction : std::uint8_t
+{
+    Press,
+    Repeat,
+    Release,
+};
+
+// A key going down, repeating or coming up, as reported by the kitty
+// keyboard protocol. Text keys have type Char and their unshifted
+// character in ch; the text a press types (shifted, composed) follows it as
+// char events.
+struct KeyChange
+{
+    KeyType type = KeyType::Unknown;
+    char32_t ch = 0;
+    KeyAction action = KeyAction::Press;
+    std::uint8_t mods = 0;
+};
+
+enum class MouseButton : std::uint8_t
+{
+    None,
+    Left,
+    Middle,
+    Right,
+    WheelUp,
+    WheelDown,
+    WheelLeft,
+    WheelRight,
+};
+
+enum class MouseAction : std::uint8_t
+{
+    Press,   // wheel steps are presses of the wheel buttons
+    Release,
+    Drag,    // motion with a button held
+    Move,    // motion with no button held
+};
+
+// x and y are framebuffer pixels. A cell shows two pixel rows, so without
+// pixel-precise reports y is the upper row of the cell.
+struct MouseEvent
+{
+    MouseAction action;
+    MouseButton button;
+    std::uint8_t mods;
+    int x;
+    int y;
+};
+
+// Text pasted while bracketed paste is on, delivered whole. The view points
+// into a buffer the input side reuses, so it is only valid until the next
+// event is taken.
+struct PasteEvent
+{
+    std::string_view text;
+    int buffer; // which paste buffer to hand back
+};
+
+using KeyEvent = std::variant<char, KeyType, MouseEvent, KeyChange, PasteEvent>;
+
+// Whether e presses (or repeats) key t, however the terminal reported it.
+inline bool isKeyPress(const KeyEvent& e, KeyType t)
+{
+    if (auto* k = std::get_if<KeyType>(&e))
+        return *k == t;
+    auto* k = std::get_if<KeyChange>(&e);
+    return k && k->type == t && k->action != KeyAction::Release;
+}
+
+// Which keys are down, from KeyChange events; only terminals speaking the
+// kitty protocol report releases, so others never mark anything held.
+class KeyboardState
+{
+public:
+    void apply(const KeyEvent& e)
+    {
+        auto* k = std::get_if<KeyChange>(&e);
+        if (!k)
+            return;
+        size_t i = k->type == KeyType::Char ? textIndex(k->ch) : typeIndex(k->type);
+        if (i < held.size())
+            held[i] = k->action != KeyAction::Release;
+    }
+
+    bool isHeld(KeyType t) const
+    {
+        return held[typeIndex(t)];
+    }
+
+    // ASCII only; letters in either case.
+    bool isHeld(char32_t c) const
+    {
+        size_t i = textIndex(c);
+        return i < held.size() && held[i];
+    }
+
+    void clear()
+    {
+        held.reset();
+    }
+
+private:
+    std::bitset<128 + size_t(KeyType::Unknown) + 1> held;
+
+    static size_t textIndex(char32_t c)
+    {
+        return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c < 128 ? size_t(c) : ~size_t(0);
+    }
+
+    static size_t typeIndex(KeyType t)
+    {
+        return 128 + size_t(t);
+    }
+};
+
+// Whether two events are motion reports that can be merged into the later
+// one without losing a press, release or modifier change.
+inline bool coalesces(const KeyEvent& a, const KeyEvent& b)
+{
+    auto* m = std::get_if<MouseEvent>(&a);
+    auto* n = std::get_if<MouseEvent>(&b);
+    return m && n && (m->action == MouseAction::Drag || m->action == MouseAction::Move) &&
+        m->action == n->action && m->button == n->button && m->mods == n->mods;
+}
+
+inline void putUtf8(char*& p, char32_t cp)
+{
+    if (cp < 0x80)
+        *p++ = char(cp);
+    else if (cp < 0x800)
+    {
+        *p++ = char(0xC0 | cp >> 6);
+        *p++ = char(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        *p++ = char(0xE0 | cp >> 12);
+        *p++ = char(0x80 | (cp >> 6 & 0x3F));
+        *p++ = char(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        *p++ = char(0xF0 | cp >> 18);
+        *p++ = char(0x80 | (cp >> 12 & 0x3F));
+        *p++ = char(0x80 | (cp >> 6 & 0x3F));
+        *p++ = char(0x80 | (cp & 0x3F));
+    }
+}
 
 #ifdef _WIN32
 
@@ -129,7 +630,8 @@ WORD rgbToWinAttr(int r, int g, int b)
 
 #ifndef _WIN32
 termios origTerm;
-std::deque<char> inputBuffer;
+std::atomic<bool> mousePixels{false};
+std::atomic<bool> kittyKeyboard{false};
 
 void enableRawInput()
 {
@@ -138,146 +640,4330 @@ void enableRawInput()
     t.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &t);
     fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK);
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-void restoreTerminal()
+// Turns on SGR mouse reports (1006) for presses, drags and, with
+// allMotion, plain moves. Pixel-precise reports (1016) are asked for on top
+// only when the terminal tells us its cell size, since that is needed to map
+// them; 1016 refines 1006, so it has to come after it.
+void enableMouse(bool allMotion)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &origTerm);
+    winsize ws{};
+    bool pixels = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_xpixel > 0 && ws.ws_ypixel > 0;
+    mousePixels = pixels;
+    std::string seq = allMotion ? "\x1b[?1003h" : "\x1b[?1002h";
+    seq += "\x1b[?1006h";
+    if (pixels)
+        seq += "\x1b[?1016h";
+    write(STDOUT_FILENO, seq.data(), seq.size());
 }
 
-std::vector<KeyEvent> pollInput()
+// Asks for the kitty keyboard protocol, which reports presses, repeats and
+// releases of every key with modifiers. Only terminals that support it answer
+// the flags query, and every terminal answers the device attributes query
+// sent after it, so that answer ends the wait either way. Call before input
+// is read anywhere else.
+bool enableKittyKeyboard()
 {
-    std::vector<KeyEvent> keys;
-    char buf[32];
-    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    static constexpr char query[] = "\x1b[?u\x1b[c";
+    write(STDOUT_FILENO, query, sizeof(query) - 1);
 
-    for (ssize_t i = 0; i < n; ++i)
-        inputBuffer.push_back(buf[i]);
-
-    while (!inputBuffer.empty())
+    using clock = std::chrono::steady_clock;
+    auto deadline = clock::now() + std::chrono::milliseconds(200);
+    std::string reply;
+    bool supported = false;
+    bool answered = false;
+    for (size_t scanned = 0; !answered;)
     {
-        char c = inputBuffer.front();
-        inputBuffer.pop_front();
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now());
+        pollfd pfd{STDIN_FILENO, POLLIN, 0};
+        if (left.count() <= 0 || poll(&pfd, 1, int(left.count())) <= 0)
+            break;
+        char buf[64];
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n == 0)
+            break;
+        if (n > 0)
+            reply.append(buf, n);
 
-        if (c == '\x1b')
+        // Replies look like ESC [ ? digits/';' then 'u' or 'c'.
+        for (size_t at; (at = reply.find("\x1b[?", scanned)) != std::string::npos;)
         {
-            if (inputBuffer.size() >= 2 && inputBuffer[0] == '[')
-            {
-                char code = inputBuffer[1];
-                inputBuffer.pop_front();
-                inputBuffer.pop_front();
-
-                switch (code)
-                {
-                case 'A': keys.emplace_back(KeyType::Up);
-                    break;
-                case 'B': keys.emplace_back(KeyType::Down);
-                    break;
-                case 'C': keys.emplace_back(KeyType::Right);
-                    break;
-                case 'D': keys.emplace_back(KeyType::Left);
-                    break;
-                default: keys.emplace_back(KeyType::Unknown);
-                    break;
-                }
-            }
+            size_t end = reply.find_first_not_of("0123456789;", at + 3);
+            if (end == std::string::npos)
+                break;
+            supported |= reply[end] == 'u';
+            answered |= reply[end] == 'c';
+            scanned = end;
         }
-        else if (c == '\n' || c == '\r')
-            keys.emplace_back(KeyType::Enter);
-        else if (c == 127)
-            keys.emplace_back(KeyType::Backspace);
-        else
-            keys.emplace_back(c);
     }
-    return keys;
-}
-#endif
 
-bool getTerminalSize(int& w, int& h)
-{
-#ifdef _WIN32
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    if (!GetConsoleScreenBufferInfo(hConsole, &csbi))
-        return false;
-    w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-    h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-#else
-    winsize ws{};
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
-        return false;
-    w = ws.ws_col;
-    h = ws.ws_row;
-#endif
-    return true;
+    if (supported)
+    {
+        // 1 disambiguate, 2 report event types, 8 report all keys as
+        // escapes, 16 with the text they produce.
+        static constexpr char push[] = "\x1b[>27u";
+        write(STDOUT_FILENO, push, sizeof(push) - 1);
+        kittyKeyboard = true;
+    }
+    return supported;
 }
 
-void limitFPS(int fps)
+void restoreTerminal()
 {
-    using clock = std::chrono::steady_clock;
-    static auto next = clock::now();
-    next += std::chrono::nanoseconds(1'000'000'000 / fps);
-    std::this_thread::sleep_until(next);
+    if (kittyKeyboard)
+        write(STDOUT_FILENO, "\x1b[<u", 4);
+    static constexpr char reset[] = "\x1b[?2004l\x1b[?1016l\x1b[?1006l\x1b[?1003l\x1b[?1002l\x1b[0m\x1b[?25h";
+    write(STDOUT_FILENO, reset, sizeof(reset) - 1);
+    tcsetattr(STDIN_FILENO, TCSANOW, &origTerm);
 }
 
-class Window
+// Turns terminal input bytes into key events in one pass. A sequence cut off
+// at the end of a read is kept until the next one; an ESC that ends a read
+// with nothing after it is the Escape key itself.
+//
+// Bracketed pastes are collected into one of two reusable buffers and come
+// out as a single PasteEvent viewing it. The buffer stays reserved until
+// releasePaste, which may be called from another thread; a paste arriving
+// while both are reserved comes out as plain chars instead.
+class InputParser
 {
 public:
-    Window()
+    void releasePaste(int buffer)
     {
-        clear({0, 0, 0});
+        pasteBusy[buffer].store(false, std::memory_order_release);
     }
 
-    void clear(Color c)
+    template <typename Emit>
+    void feed(const char* data, size_t n, Emit emit)
     {
-        int v = compactColor(c);
-        for (auto& row : buffer)
-            row.fill(v);
+        pending.append(data, n);
+        size_t i = 0;
+        while (i < pending.size())
+        {
+            size_t used = parseOne(i, emit);
+            if (used == 0)
+                break;
+            i += used;
+        }
+        pending.erase(0, i);
     }
 
-    void drawPixel(int x, int y, Color c)
+private:
+    static constexpr std::string_view pasteEnd = "\x1b[201~";
+
+    std::string pending;
+    bool inPaste = false;
+    int pasteBuffer = -1; // -1 while passing a paste on as chars
+    std::string pasteText[2];
+    std::atomic<bool> pasteBusy[2] = {};
+
+    // Paste bytes up to the end marker; the last few are held back while
+    // they could be the start of a marker cut off by the read.
+    template <typename Emit>
+    size_t parsePaste(size_t i, Emit& emit)
     {
-        if (x < 0 || y < 0 || x >= 300 || y >= 300)
-            return;
-        buffer[y][x] = compactColor(c);
+        size_t end = pending.find(pasteEnd, i);
+        size_t take = end == std::string::npos
+                          ? pending.size() - std::min(pending.size(), i + pasteEnd.size() - 1)
+                          : end - i;
+        if (pasteBuffer >= 0)
+            pasteText[pasteBuffer].append(pending, i, take);
+        else
+            std::for_each(pending.begin() + i, pending.begin() + i + take, [&](char c) { emit(c); });
+        if (end == std::string::npos)
+            return take;
+
+        if (pasteBuffer >= 0)
+            emit(PasteEvent{pasteText[pasteBuffer], pasteBuffer});
+        inPaste = false;
+        return take + pasteEnd.size();
     }
 
-    void drawLine(int x0, int y0, int x1, int y1, Color c)
+    void beginPaste()
     {
-        int dx = abs(x1 - x0);
-        int dy = abs(y1 - y0);
-        int steps = max(dx, dy);
-
-        if (steps == 0)
+        inPaste = true;
+        pasteBuffer = -1;
+        for (int b = 0; b < 2; ++b)
         {
-            drawPixel(x0, y0, c);
-            return;
+            if (!pasteBusy[b].exchange(true, std::memory_order_acquire))
+            {
+                pasteBuffer = b;
+                pasteText[b].clear();
+                return;
+            }
         }
+    }
 
-        int packed = compactColor(c);
+    // Up to 4 ';'-separated parameters of up to 3 ':'-separated numbers
+    // each, missing ones 0; returns how many parameters there were.
+    using Params = std::array<std::array<int, 3>, 4>;
 
-        for (int i = 0; i <= steps; ++i)
+    static int parseParams(std::string_view s, Params& out)
+    {
+        out = {};
+        int count = 0;
+        int sub = 0;
+        for (char c : s)
         {
-            float t = static_cast<float>(i) / steps;
-            int x = static_cast<int>(x0 + t * (x1 - x0));
-            int y = static_cast<int>(y0 + t * (y1 - y0));
-
-            if (x >= 0 && y >= 0 && x < 300 && y < 300)
-                buffer[y][x] = packed;
+            if (c == ';')
+            {
+                ++count;
+                sub = 0;
+            }
+            else if (c == ':')
+                ++sub;
+            else if (c >= '0' && c <= '9' && count < 4 && sub < 3)
+                out[count][sub] = out[count][sub] * 10 + (c - '0');
         }
+        return count + 1;
     }
 
-    void present() const
+    // Keys that the kitty protocol (and xterm, for modified keys) reports
+    // with a final byte or as CSI number ~.
+    static KeyType functionalKey(char final, int number)
     {
-        drawBuffer(buffer);
-    }
+        switch (final)
+        {
+        case 'A': return KeyType::Up;
+        case 'B': return KeyType::Down;
+        case 'C': return KeyType::Right;
+        case 'D': return KeyType::Left;
+        case 'H': return KeyType::Home;
+        case 'F': return KeyType::End;
+        case 'P': return KeyType::F1;
+        case 'Q': return KeyType::F2;
+        case 'S': return KeyType::F4;
+        case '~': break;
+        default: return KeyType::Unknown;
+        }
 
-private:
-    screen buffer{};
+        switch (number)
+        {
+        case 2: return KeyType::Insert;
+        case 3: return KeyType::Delete;
+        case 5: return KeyType::PageUp;
+        case 6: return KeyType::PageDown;
+        case 7: return KeyType::Home;
+        case 8: return KeyType::End;
+        case 11: return KeyType::F1;
+        case 12: return KeyType::F2;
+        case 13: return KeyType::F3;
+        case 14: return KeyType::F4;
+        case 15: return KeyType::F5;
+        case 17: return KeyType::F6;
+        case 18: return KeyType::F7;
+        case 19: return KeyType::F8;
+        case 20: return KeyType::F9;
+        case 21: return KeyType::F10;
+        case 23: return KeyType::F11;
+        case 24: return KeyType::F12;
+        default: return KeyType::Unknown;
+        }
+    }
 
-    static void drawBuffer(const screen& pixelBuff)
+    // CSI code u: a Unicode code point, or one of the protocol's private
+    // codes for keys without one.
+    static KeyChange textKey(int code)
+    {
+        switch (code)
+        {
+        case 9: return {KeyType::Tab};
+        case 13: return {KeyType::Enter};
+        case 27: return {KeyType::Escape};
+        case 127: return {KeyType::Backspace};
+        case 57441:
+        case 57447: return {KeyType::Shift};
+        case 57442:
+        case 57448: return {KeyType::Ctrl};
+        case 57443:
+        case 57449: return {KeyType::Alt};
+        default: break;
+        }
+        if (code < 32 || (code >= 57344 && code <= 63743) || code > 0x10FFFF)
+            return {KeyType::Unknown};
+        return {KeyType::Char, char32_t(code)};
+    }
+
+    // SS3 final bytes: cursor keys in application mode, and F1-F4 on xterm
+    // and most terminals copying it.
+    static KeyType ss3Key(char final)
+    {
+        switch (final)
+        {
+        case 'A': return KeyType::Up;
+        case 'B': return KeyType::Down;
+        case 'C': return KeyType::Right;
+        case 'D': return KeyType::Left;
+        case 'H': return KeyType::Home;
+        case 'F': return KeyType::End;
+        case 'M': return KeyType::Enter;
+        case 'P': return KeyType::F1;
+        case 'Q': return KeyType::F2;
+        case 'R': return KeyType::F3;
+        case 'S': return KeyType::F4;
+        default: return KeyType::Unknown;
+        }
+    }
+
+    // A modified key from a terminal that never reports releases, sent as a
+    // press and release so KeyboardState doesn't keep it held.
+    template <typename Emit>
+    static void emitTap(KeyChange k, Emit& emit)
+    {
+        emit(k);
+        if (!kittyKeyboard)
+        {
+            k.action = KeyAction::Release;
+            emit(k);
+        }
+    }
+
+    // b is the SGR button code, x and y the 0-based report position in
+    // cells or, in 1016 mode, terminal pixels.
+    static MouseEvent mouseEvent(int b, int x, int y, bool pressed)
+    {
+        MouseEvent m{};
+        m.mods = (b & 4 ? ModShift : 0) | (b & 8 ? ModAlt : 0) | (b & 16 ? ModCtrl : 0);
+        if (b & 64)
+        {
+            m.action = MouseAction::Press;
+            m.button = MouseButton(int(MouseButton::WheelUp) + (b & 3));
+        }
+        else
+        {
+            m.button = (b & 3) == 3 || (b & 128) ? MouseButton::None : MouseButton(1 + (b & 3));
+            if (b & 32)
+                m.action = m.button == MouseButton::None ? MouseAction::Move : MouseAction::Drag;
+            else
+                m.action = pressed ? MouseAction::Press : MouseAction::Release;
+        }
+
+        x = std::max(x, 0);
+        y = std::max(y, 0);
+        winsize ws{};
+        if (mousePixels && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col && ws.ws_row &&
+            ws.ws_xpixel && ws.ws_ypixel)
+        {
+            int cellW = std::max(1, ws.ws_xpixel / ws.ws_col);
+            int cellH = std::max(1, ws.ws_ypixel / ws.ws_row);
+            m.x = x / cellW;
+            m.y = y / cellH * 2 + (y % cellH) * 2 / cellH;
+        }
+        else
+        {
+            m.x = x;
+            m.y = y * 2;
+        }
+        return m;
+    }
+
+    // Bytes taken by the event at i, or 0 if it isn't complete yet.
+    template <typename Emit>
+    size_t parseOne(size_t i, Emit& emit)
+    {
+        if (inPaste)
+            return parsePaste(i, emit);
+
+        char c = pending[i];
+        size_t left = pending.size() - i;
+        if (c == '\x1b')
+        {
+            char next = left > 1 ? pending[i + 1] : 0;
+            if (next == 'O' && left > 2 && ss3Key(pending[i + 2]) != KeyType::Unknown)
+            {
+                emit(ss3Key(pending[i + 2]));
+                return 3;
+            }
+
+            // Without the kitty protocol, Alt+key arrives as ESC and the key.
+            if ((next >= 0x20 && next < 0x7F && next != '[') || next == 127)
+            {
+                KeyChange k = next == 127 ? KeyChange{KeyType::Backspace} : KeyChange{KeyType::Char, char32_t(next)};
+                k.mods = ModAlt;
+                emitTap(k, emit);
+                return 2;
+            }
+
+            if (next != '[')
+            {
+                emit(KeyType::Escape);
+                return 1;
+            }
+
+            // CSI: parameter and intermediate bytes, then a final byte.
+            size_t end = i + 2;
+            while (end < pending.size() && (pending[end] < 0x40 || pending[end] > 0x7E))
+                ++end;
+            if (end == pending.size())
+                return 0;
+
+            char final = pending[end];
+            std::string_view body = std::string_view(pending).substr(i + 2, end - i - 2);
+            Params v;
+            if (body.starts_with('<') && (final == 'M' || final == 'm'))
+            {
+                if (parseParams(body.substr(1), v) == 3)
+                    emit(mouseEvent(v[0][0], v[1][0] - 1, v[2][0] - 1, final == 'M'));
+                return end + 1 - i;
+            }
+
+            // Replies to queries (device attributes, keyboard flags).
+            if (body.starts_with('?'))
+                return end + 1 - i;
+
+            if (final == '~' && body == "200")
+            {
+                beginPaste();
+                return end + 1 - i;
+            }
+
+            // CSI code;mods:event u, CSI 1;mods:event A..S and CSI n;mods:event ~
+            // carry modifiers and press/repeat/release; so do bare final
+            // bytes once the kitty protocol is on.
+            bool bare = body.empty();
+            if (final == 'u' || !bare || kittyKeyboard)
+            {
+                parseParams(body, v);
+                KeyChange k = final == 'u' ? textKey(v[0][0]) : KeyChange{functionalKey(final, v[0][0])};
+                int mods = std::max(v[1][0], 1) - 1;
+                k.mods = std::uint8_t(mods & (ModShift | ModAlt | ModCtrl | ModSuper));
+                k.action = v[1][1] == 3 ? KeyAction::Release : v[1][1] == 2 ? KeyAction::Repeat : KeyAction::Press;
+                if (k.type != KeyType::Unknown || final == 'u')
+                {
+                    emitTap(k, emit);
+                    // The text the key types, as code points in the third
+                    // parameter, goes on as UTF-8 chars like unencoded keys.
+                    if (final == 'u' && k.action != KeyAction::Release)
+                    {
+                        for (int cp : v[2])
+                        {
+                            char utf8[4];
+                            char* e = utf8;
+                            if (cp > 0 && cp <= 0x10FFFF)
+                                putUtf8(e, char32_t(cp));
+                            std::for_each(utf8, e, [&](char ch) { emit(ch); });
+                        }
+                    }
+                    return end + 1 - i;
+                }
+            }
+
+            switch (bare ? final : 0)
+            {
+            case 'A': emit(KeyType::Up);
+                break;
+            case 'B': emit(KeyType::Down);
+                break;
+            case 'C': emit(KeyType::Right);
+                break;
+            case 'D': emit(KeyType::Left);
+                break;
+            default: emit(KeyType::Unknown);
+                break;
+            }
+            return end + 1 - i;
+        }
+
+        if (c == '\n' || c == '\r')
+            emit(KeyType::Enter);
+        else if (c == 127)
+            emit(KeyType::Backspace);
+        else
+            emit(c);
+        return 1;
+    }
+};
+#endif
+
+// Single-producer single-consumer queue of fixed, power-of-two capacity.
+// Each side only stores its own index and caches the other one, so neither
+// takes a lock and the common case touches no shared cache line.
+template <typename T, size_t N>
+class SpscRing
+{
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // Producer side; false if the ring is full.
+    bool push(const T& item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - headSeen == N)
+        {
+            headSeen = head.load(std::memory_order_acquire);
+            if (t - headSeen == N)
+                return false;
+        }
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: the oldest item without taking it, or nullptr.
+    const T* front()
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tailSeen)
+        {
+            tailSeen = tail.load(std::memory_order_acquire);
+            if (h == tailSeen)
+                return nullptr;
+        }
+        return &items[h & (N - 1)];
+    }
+
+    // Consumer side; false if the ring is empty.
+    bool pop(T& item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tailSeen)
+        {
+            tailSeen = tail.load(std::memory_order_acquire);
+            if (h == tailSeen)
+                return false;
+        }
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::array<T, N> items{};
+    alignas(64) std::atomic<size_t> head{0};
+    size_t tailSeen = 0;
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t headSeen = 0;
+};
+
+struct InputEvent
+{
+    KeyEvent key;
+    std::chrono::steady_clock::time_point time; // when the bytes were read
+};
+
+// Reads and parses input on its own thread, blocking on stdin instead of
+// polling once per frame, and queues timestamped events for the main loop.
+// Events that arrive while the queue is full are dropped and counted.
+//
+// Runs of mouse motion are merged into their last report, both per read on
+// the way in and across everything queued when the main loop drains, so a
+// fast drag gives about one event per frame.
+class InputThread
+{
+public:
+    InputThread()
+    {
+#ifndef _WIN32
+        if (pipe(wake) != 0)
+            wake[0] = wake[1] = -1;
+#endif
+        worker = std::thread([this] { run(); });
+    }
+
+    ~InputThread()
+    {
+        stop.store(true, std::memory_order_relaxed);
+#ifndef _WIN32
+        if (wake[1] >= 0)
+            write(wake[1], "", 1);
+#endif
+        worker.join();
+#ifndef _WIN32
+        for (int fd : wake)
+            if (fd >= 0)
+                close(fd);
+#endif
+    }
+
+    InputThread(const InputThread&) = delete;
+    InputThread& operator=(const InputThread&) = delete;
+
+    // Takes the oldest queued event; doesn't block or allocate. A paste's
+    // text stays valid until the next call.
+    bool next(InputEvent& e)
+    {
+#ifndef _WIN32
+        if (heldPaste >= 0)
+            parser.releasePaste(heldPaste);
+        heldPaste = -1;
+#endif
+        if (!events.pop(e))
+            return false;
+        for (const InputEvent* f; (f = events.front()) && coalesces(e.key, f->key);)
+            events.pop(e);
+#ifndef _WIN32
+        if (auto* p = std::get_if<PasteEvent>(&e.key))
+            heldPaste = p->buffer;
+#endif
+        return true;
+    }
+
+    size_t dropped() const
+    {
+        return droppedCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    SpscRing<InputEvent, 256> events;
+    std::atomic<size_t> droppedCount{0};
+    std::atomic<bool> stop{false};
+    std::thread worker;
+#ifndef _WIN32
+    int wake[2] = {-1, -1};
+    InputParser parser;
+    int heldPaste = -1;
+#endif
+
+    void push(KeyEvent key, std::chrono::steady_clock::time_point time)
+    {
+        if (events.push({key, time}))
+            return;
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+#ifndef _WIN32
+        if (auto* p = std::get_if<PasteEvent>(&key))
+            parser.releasePaste(p->buffer);
+#endif
+    }
+
+    void run()
+    {
+        CLON_THREAD_NAME("input");
+#ifdef _WIN32
+        HANDLE hIn = GetStdHandle(STD_INPUT_HANDLE);
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            if (WaitForSingleObject(hIn, 50) != WAIT_OBJECT_0)
+                continue;
+            auto now = std::chrono::steady_clock::now();
+            for (auto& k : pollInput())
+                push(k, now);
+        }
+#else
+        char buf[4096];
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wake[0], POLLIN, 0}};
+            if (poll(fds, wake[0] >= 0 ? 2 : 1, wake[0] >= 0 ? -1 : 50) <= 0)
+                continue;
+            if (fds[1].revents)
+                break;
+
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                break;
+            if (n < 0)
+                continue;
+            CLON_ZONE("parse");
+            auto now = std::chrono::steady_clock::now();
+            std::optional<KeyEvent> motion;
+            parser.feed(buf, n, [&](KeyEvent k)
+            {
+                if (motion && !coalesces(*motion, k))
+                    push(*motion, now);
+                motion.reset();
+                if (coalesces(k, k))
+                    motion = k;
+                else
+                    push(k, now);
+            });
+            if (motion)
+                push(*motion, now);
+        }
+#endif
+    }
+};
+
+// Input logs: the events the main loop took, frame by frame, plus terminal
+// resizes, so a session can be replayed into the loop and reproduce the same
+// frames. After an 8-byte magic every record is
+//   varint frames since the previous record, varint microseconds since it,
+//   u8 kind, payload
+// with varints LEB128 and payloads as written by InputRecorder::record.
+enum class LogRecord : std::uint8_t
+{
+    Char,
+    Key,
+    Mouse,
+    KeyChange,
+    Paste,
+    Resize,
+    End, // varint frame count, u64 digest of the frames shown
+};
+
+inline constexpr char inputLogMagic[8] = {'C', 'L', 'O', 'N', 'I', 'N', 'P', '1'};
+
+inline void appendVarint(std::string& out, std::uint64_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        out.push_back(char(v | 0x80));
+    out.push_back(char(v));
+}
+
+class InputRecorder
+{
+public:
+    bool open(const char* path)
+    {
+        file.open(path, std::ios::binary | std::ios::trunc);
+        file.write(inputLogMagic, sizeof(inputLogMagic));
+        last = std::chrono::steady_clock::now();
+        return bool(file);
+    }
+
+    bool isOpen() const
+    {
+        return file.is_open();
+    }
+
+    void record(std::uint32_t frame, const InputEvent& e)
+    {
+        std::visit([&](const auto& k)
+        {
+            using T = std::decay_t<decltype(k)>;
+            if constexpr (std::is_same_v<T, char>)
+            {
+                begin(frame, e.time, LogRecord::Char);
+                buf.push_back(k);
+            }
+            else if constexpr (std::is_same_v<T, KeyType>)
+            {
+                begin(frame, e.time, LogRecord::Key);
+                buf.push_back(char(k));
+            }
+            else if constexpr (std::is_same_v<T, MouseEvent>)
+            {
+                begin(frame, e.time, LogRecord::Mouse);
+                buf.push_back(char(k.action));
+                buf.push_back(char(k.button));
+                buf.push_back(char(k.mods));
+                appendVarint(buf, std::uint32_t(k.x));
+                appendVarint(buf, std::uint32_t(k.y));
+            }
+            else if constexpr (std::is_same_v<T, KeyChange>)
+            {
+                begin(frame, e.time, LogRecord::KeyChange);
+                buf.push_back(char(k.type));
+                appendVarint(buf, k.ch);
+                buf.push_back(char(k.action));
+                buf.push_back(char(k.mods));
+            }
+            else
+            {
+                begin(frame, e.time, LogRecord::Paste);
+                appendVarint(buf, k.text.size());
+                buf.append(k.text);
+            }
+        }, e.key);
+        flush();
+    }
+
+    void recordResize(std::uint32_t frame, int cols, int rows)
+    {
+        begin(frame, std::chrono::steady_clock::now(), LogRecord::Resize);
+        appendVarint(buf, std::uint32_t(cols));
+        appendVarint(buf, std::uint32_t(rows));
+        flush();
+    }
+
+    // Ends the log with the frame count and a digest of the frames shown,
+    // which a replay checks its own frames against.
+    void finish(std::uint32_t frames, std::uint64_t digest)
+    {
+        begin(frames, std::chrono::steady_clock::now(), LogRecord::End);
+        appendVarint(buf, frames);
+        buf.append(reinterpret_cast<const char*>(&digest), sizeof(digest));
+        flush();
+        file.close();
+    }
+
+private:
+    std::ofstream file;
+    std::string buf;
+    std::uint32_t lastFrame = 0;
+    std::chrono::steady_clock::time_point last;
+
+    void begin(std::uint32_t frame, std::chrono::steady_clock::time_point time, LogRecord kind)
+    {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(time - last).count();
+        appendVarint(buf, frame - lastFrame);
+        appendVarint(buf, std::uint64_t(std::max<long long>(us, 0)));
+        buf.push_back(char(kind));
+        lastFrame = frame;
+        last = std::max(last, time);
+    }
+
+    void flush()
+    {
+        file.write(buf.data(), std::streamsize(buf.size()));
+        buf.clear();
+    }
+};
+
+// Plays an input log back: next hands out the events recorded for a frame,
+// and resizes recorded up to then show in size. Event times are rebuilt from
+// the recorded gaps on top of the time the replay was opened.
+class InputReplay
+{
+public:
+    bool open(const char* path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (data.size() < sizeof(inputLogMagic) ||
+            !std::equal(inputLogMagic, inputLogMagic + sizeof(inputLogMagic), data.begin()))
+            return false;
+        pos = sizeof(inputLogMagic);
+        time = std::chrono::steady_clock::now();
+        readHeader();
+        return true;
+    }
+
+    // The next event recorded for frame, or false once there are no more.
+    // The text of a paste stays valid until the next call.
+    bool next(std::uint32_t frame, InputEvent& e)
+    {
+        while (more && recordFrame <= frame)
+        {
+            LogRecord kind = LogRecord(byte());
+            e.time = time;
+            switch (kind)
+            {
+            case LogRecord::Char:
+                e.key = char(byte());
+                break;
+            case LogRecord::Key:
+                e.key = KeyType(byte());
+                break;
+            case LogRecord::Mouse:
+            {
+                MouseEvent m{};
+                m.action = MouseAction(byte());
+                m.button = MouseButton(byte());
+                m.mods = byte();
+                m.x = int(varint());
+                m.y = int(varint());
+                e.key = m;
+                break;
+            }
+            case LogRecord::KeyChange:
+            {
+                KeyChange k{};
+                k.type = KeyType(byte());
+                k.ch = char32_t(varint());
+                k.action = KeyAction(byte());
+                k.mods = byte();
+                e.key = k;
+                break;
+            }
+            case LogRecord::Paste:
+            {
+                size_t n = std::min(size_t(varint()), data.size() - pos);
+                paste.assign(data.data() + pos, n);
+                pos += n;
+                e.key = PasteEvent{paste, 0};
+                break;
+            }
+            case LogRecord::Resize:
+                cols = int(varint());
+                rows = int(varint());
+                readHeader();
+                continue;
+            case LogRecord::End:
+                frames = std::uint32_t(varint());
+                if (data.size() - pos >= sizeof(std::uint64_t))
+                {
+                    std::uint64_t d;
+                    std::memcpy(&d, data.data() + pos, sizeof(d));
+                    recordedDigest = d;
+                }
+                more = false;
+                return false;
+            default:
+                more = false;
+                return false;
+            }
+            readHeader();
+            return true;
+        }
+        return false;
+    }
+
+    // The terminal size as of the records read so far.
+    bool size(int& w, int& h) const
+    {
+        w = cols;
+        h = rows;
+        return cols > 0 && rows > 0;
+    }
+
+    // Whether frame is past the end of the recording.
+    bool finished(std::uint32_t frame) const
+    {
+        return !more && frame >= frames;
+    }
+
+    // The digest the recording ended with; reads ahead to the end record,
+    // which a replay stopped early hasn't reached.
+    std::optional<std::uint64_t> digest()
+    {
+        for (InputEvent e; more;)
+            next(~std::uint32_t(0), e);
+        return recordedDigest;
+    }
+
+private:
+    std::vector<char> data;
+    size_t pos = 0;
+    bool more = false;
+    std::uint32_t recordFrame = 0;
+    std::uint32_t frames = 0;
+    std::chrono::steady_clock::time_point time;
+    int cols = 0;
+    int rows = 0;
+    std::string paste;
+    std::optional<std::uint64_t> recordedDigest;
+
+    std::uint8_t byte()
+    {
+        return pos < data.size() ? std::uint8_t(data[pos++]) : 0;
+    }
+
+    std::uint64_t varint()
+    {
+        std::uint64_t v = 0;
+        for (int shift = 0; pos < data.size() && shift < 64; shift += 7)
+        {
+            auto b = std::uint8_t(data[pos++]);
+            v |= std::uint64_t(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                break;
+        }
+        return v;
+    }
+
+    void readHeader()
+    {
+        more = pos < data.size();
+        if (!more)
+            return;
+        recordFrame += std::uint32_t(varint());
+        time += std::chrono::microseconds(varint());
+        frames = recordFrame;
+    }
+};
+
+// Optional escape sequences the encoder may use.
+struct TerminalCaps
+{
+    bool bce = false; // erases (ECH/EL) fill with the current background
+    bool rep = false; // REP repeats the previous character
+};
+
+// There is no reliable query for these, so go by $TERM like terminfo would.
+TerminalCaps detectTerminalCaps()
+{
+    const char* term = std::getenv("TERM");
+    std::string_view t = term ? term : "";
+    auto has = [&](std::string_view s) { return t.find(s) != std::string_view::npos; };
+
+    TerminalCaps caps;
+    caps.bce = has("xterm") || has("kitty") || has("foot") || has("alacritty") ||
+        has("wezterm") || has("tmux") || has("screen");
+    caps.rep = has("xterm") || has("kitty") || has("foot") || has("wezterm");
+    return caps;
+}
+
+bool getTerminalSize(int& w, int& h)
+{
+#ifdef _WIN32
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!GetConsoleScreenBufferInfo(hConsole, &csbi))
+        return false;
+    w = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    h = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+#else
+    winsize ws{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1)
+        return false;
+    w = ws.ws_col;
+    h = ws.ws_row;
+#endif
+    return true;
+}
+
+// With the virtual clock on, limitFPS advances virtualTime by a frame
+// instead of sleeping, so headless replays run as fast as they can.
+bool virtualClock = false;
+std::chrono::steady_clock::time_point virtualTime;
+
+void limitFPS(int fps)
+{
+    using clock = std::chrono::steady_clock;
+    if (virtualClock)
+    {
+        virtualTime += std::chrono::nanoseconds(1'000'000'000 / fps);
+        return;
+    }
+    CLON_ZONE("sleep");
+    static auto next = clock::now();
+    next += std::chrono::nanoseconds(1'000'000'000 / fps);
+    std::this_thread::sleep_until(next);
+}
+
+#ifndef _WIN32
+#ifdef CLON_URING
+// The few io_uring calls the output needs, made straight through syscall()
+// since liburing isn't a dependency: one submission and completion ring,
+// optionally with registered buffers.
+class IoUring
+{
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring()
+    {
+        if (ringFd < 0)
+            return;
+        munmap(sqes, sqesBytes);
+        if (cqRing != sqRing)
+            munmap(cqRing, cqBytes);
+        munmap(sqRing, sqBytes);
+        close(ringFd);
+    }
+
+    bool init(unsigned entries)
+    {
+        io_uring_params params{};
+        int fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0)
+            return false;
+
+        sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqBytes = cqBytes = std::max(sqBytes, cqBytes);
+        sqesBytes = params.sq_entries * sizeof(io_uring_sqe);
+
+        auto map = [fd](size_t bytes, off_t what)
+        {
+            void* m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+            return m == MAP_FAILED ? nullptr : static_cast<char*>(m);
+        };
+        sqRing = map(sqBytes, IORING_OFF_SQ_RING);
+        cqRing = single ? sqRing : map(cqBytes, IORING_OFF_CQ_RING);
+        char* sqeMem = map(sqesBytes, IORING_OFF_SQES);
+        if (!sqRing || !cqRing || !sqeMem)
+        {
+            if (sqeMem)
+                munmap(sqeMem, sqesBytes);
+            if (cqRing && cqRing != sqRing)
+                munmap(cqRing, cqBytes);
+            if (sqRing)
+                munmap(sqRing, sqBytes);
+            close(fd);
+            return false;
+        }
+
+        ringFd = fd;
+        sqes = reinterpret_cast<io_uring_sqe*>(sqeMem);
+        sqHead = reinterpret_cast<unsigned*>(sqRing + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sqRing + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned*>(sqRing + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sqRing + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        cqHead = reinterpret_cast<unsigned*>(cqRing + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cqRing + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cqRing + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cqRing + params.cq_off.cqes);
+        return true;
+    }
+
+    bool registerBuffers(const iovec* bufs, unsigned n)
+    {
+        return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, bufs, n) == 0;
+    }
+
+    void unregisterBuffers()
+    {
+        syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    }
+
+    // A zeroed submission entry queued for the next submit, or nullptr if
+    // the ring is full.
+    io_uring_sqe* nextSqe()
+    {
+        unsigned tail = *sqTail + unsubmitted;
+        if (tail - std::atomic_ref(*sqHead).load(std::memory_order_acquire) >= sqEntries)
+            return nullptr;
+        io_uring_sqe* sqe = &sqes[tail & sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqArray[tail & sqMask] = tail & sqMask;
+        ++unsubmitted;
+        return sqe;
+    }
+
+    // Submits what was queued and, if waitFor > 0, blocks until that many
+    // completions are available.
+    bool submit(unsigned waitFor)
+    {
+        if (unsubmitted == 0 && waitFor == 0)
+            return true;
+        std::atomic_ref(*sqTail).store(*sqTail + unsubmitted, std::memory_order_release);
+        unsigned n = unsubmitted;
+        unsubmitted = 0;
+        long r = syscall(__NR_io_uring_enter, ringFd, n, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0,
+                         nullptr, 0);
+        return r >= 0 || errno == EINTR;
+    }
+
+    template <typename Fn>
+    void reap(Fn fn)
+    {
+        unsigned head = *cqHead;
+        unsigned tail = std::atomic_ref(*cqTail).load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+            fn(cqes[head & cqMask]);
+        std::atomic_ref(*cqHead).store(head, std::memory_order_release);
+    }
+
+private:
+    int ringFd = -1;
+    char* sqRing = nullptr;
+    char* cqRing = nullptr;
+    size_t sqBytes = 0;
+    size_t cqBytes = 0;
+    size_t sqesBytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned sqMask = 0;
+    unsigned sqEntries = 0;
+    unsigned unsubmitted = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+// Where encoded frames go: the terminal plus any extra sinks (a recording
+// file). Frames are encoded straight into buffers owned here.
+//
+// Synchronously, a terminal fd that is a pipe (a recorder, tee to a log) gets
+// frames handed over with vmsplice instead of copied by write. The pipe keeps
+// referencing spliced pages until the reader gets to them, so pages may only
+// be reused once enough newer pages went through the pipe to have pushed
+// them out. Frames are appended page-aligned to one of two buffers, each
+// holding at least a full pipe plus the largest frame, and the other buffer
+// is only taken over once the current one is full.
+//
+// Asynchronously, frames rotate through a few registered io_uring buffers and
+// commit only queues the writes; each sink gets its frames in order, one
+// write in flight at a time, and begin only waits if every buffer is still
+// being written somewhere.
+class FrameOutput
+{
+public:
+    explicit FrameOutput(int fd = STDOUT_FILENO)
+    {
+        sinks.push_back({fd});
+        struct stat st{};
+        bool known = fstat(fd, &st) == 0;
+        if (known && S_ISREG(st.st_mode))
+            sinks.back().offset = lseek(fd, 0, SEEK_CUR);
+#ifdef CLON_SPLICE
+        if (known && S_ISFIFO(st.st_mode))
+        {
+            fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+            long size = fcntl(fd, F_GETPIPE_SZ);
+            if (size > 0)
+                pipeSlots = size / pageSize;
+        }
+#endif
+    }
+
+    ~FrameOutput()
+    {
+        flush();
+#ifdef CLON_URING
+        if (async)
+            handOverOffsets(false);
+        if (registered)
+            ring.unregisterBuffers();
+#endif
+        for (auto& b : slots)
+            unmap(b, slotBytes);
+        release();
+    }
+
+    FrameOutput(const FrameOutput&) = delete;
+    FrameOutput& operator=(const FrameOutput&) = delete;
+
+    // Turns vmsplice off for good, e.g. to compare against plain writes.
+    void disableZeroCopy()
+    {
+        pipeSlots = 0;
+    }
+
+    bool zeroCopy() const
+    {
+        return pipeSlots > 0 && !async;
+    }
+
+    // Also sends every frame to fd, e.g. a recording file opened for append.
+    void addSink(int fd)
+    {
+        flush();
+        sinks.push_back({fd});
+        struct stat st{};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+            sinks.back().offset = lseek(fd, 0, SEEK_CUR);
+    }
+
+    // Switches to io_uring output. Returns false (and stays synchronous) if
+    // the kernel doesn't support it.
+    bool setAsync(bool on)
+    {
+        flush();
+#ifdef CLON_URING
+        if (on && !ringReady)
+            ringReady = ring.init(64);
+        bool wasAsync = async;
+        async = on && ringReady;
+        if (async != wasAsync)
+            handOverOffsets(async);
+#else
+        async = false;
+#endif
+        return async == on;
+    }
+
+    bool isAsync() const
+    {
+        return async;
+    }
+
+    // Writes issued so far, retries of short ones included; io_uring writes
+    // count when they are queued.
+    std::uint64_t writeCount() const
+    {
+        return writes;
+    }
+
+    // Room for a frame of up to maxBytes; encode into it and hand the end to
+    // commit.
+    char* begin(size_t maxBytes)
+    {
+        CLON_ZONE("output.begin");
+        if (async)
+        {
+            frame = beginAsync(maxBytes);
+            return frame;
+        }
+
+        size_t pages = (maxBytes + pageSize - 1) / pageSize;
+        if (zeroCopy() && pages > bufPages - used)
+        {
+            if (pages + pipeSlots > bufPages)
+                allocate(pages + pipeSlots);
+            else if (spliced - lastUse[current ^ 1] >= long(pipeSlots))
+            {
+                current ^= 1;
+                used = 0;
+            }
+        }
+
+        if (!zeroCopy() || pages > bufPages - used)
+        {
+            if (fallback.size() < maxBytes)
+                fallback.resize(maxBytes);
+            frame = fallback.data();
+        }
+        else
+        {
+            frame = bufs[current] + used * pageSize;
+        }
+        return frame;
+    }
+
+    // Sends the frame written since begin. Returns false if a sink failed;
+    // with async output that is any write that failed since the last commit.
+    bool commit(const char* end)
+    {
+        CLON_ZONE("output.commit", end - frame);
+        size_t n = end - frame;
+        if (async)
+            return commitAsync(n);
+
+        bool ok = true;
+        for (size_t i = 1; i < sinks.size(); ++i)
+            ok &= writeAll(sinks[i].fd, frame, n);
+        if (frame == fallback.data())
+            return writeAll(sinks[0].fd, frame, n) && ok;
+        return splice(n) && ok;
+    }
+
+    // Waits for every queued write to finish.
+    void flush()
+    {
+#ifdef CLON_URING
+        while (async && std::any_of(slotRefs, slotRefs + slotCount, [](int r) { return r > 0; }))
+            waitAsync();
+#endif
+    }
+
+private:
+    struct Sink
+    {
+        int fd;
+        off_t offset = -1; // -1 for streams, which write at their position;
+                           // for files, where the next async write goes
+        int queue[4] = {}; // slots waiting for this sink, oldest first
+        int queued = 0;
+        size_t sent = 0;   // bytes of queue[0] already written
+        bool inFlight = false;
+    };
+    static constexpr int slotCount = 3;
+    static constexpr std::uint64_t pollTag = ~std::uint64_t(0);
+
+    std::vector<Sink> sinks;
+    size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    char* frame = nullptr;
+    std::string fallback;
+    std::uint64_t writes = 0;
+
+    // vmsplice
+    size_t pipeSlots = 0;
+    char* bufs[2] = {};
+    size_t bufPages = 0;
+    size_t used = 0;
+    int current = 0;
+    long spliced = 0;
+    long lastUse[2] = {};
+
+    // io_uring
+    bool async = false;
+    char* slots[slotCount] = {};
+    size_t slotBytes = 0;
+    size_t slotLen[slotCount] = {};
+    int slotRefs[slotCount] = {};
+    int nextSlot = 0;
+#ifdef CLON_URING
+    IoUring ring;
+    bool ringReady = false;
+    bool registered = false;
+    bool asyncFailed = false;
+#endif
+
+    bool writeAll(int fd, const char* data, size_t n)
+    {
+        CLON_ZONE("write", fd);
+        while (n > 0)
+        {
+            ++writes;
+            ssize_t done = write(fd, data, n);
+            if (done < 0 && errno == EAGAIN)
+            {
+                pollfd pfd{fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (done < 0 && errno != EINTR)
+                return false;
+            if (done > 0)
+            {
+                data += done;
+                n -= done;
+            }
+        }
+        return true;
+    }
+
+    bool splice(size_t n)
+    {
+#ifdef CLON_SPLICE
+        CLON_ZONE("vmsplice");
+        iovec iov{frame, n};
+        while (iov.iov_len > 0)
+        {
+            ++writes;
+            ssize_t done = vmsplice(sinks[0].fd, &iov, 1, SPLICE_F_GIFT);
+            if (done < 0 && errno == EAGAIN)
+            {
+                pollfd pfd{sinks[0].fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (done < 0 && errno != EINTR)
+            {
+                pipeSlots = 0;
+                return writeAll(sinks[0].fd, static_cast<const char*>(iov.iov_base), iov.iov_len);
+            }
+            if (done > 0)
+            {
+                iov.iov_base = static_cast<char*>(iov.iov_base) + done;
+                iov.iov_len -= done;
+            }
+        }
+#endif
+        size_t pages = (n + pageSize - 1) / pageSize;
+        used += pages;
+        spliced += pages;
+        lastUse[current] = spliced;
+        return true;
+    }
+
+    char* map(size_t bytes)
+    {
+        void* m = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return m == MAP_FAILED ? nullptr : static_cast<char*>(m);
+    }
+
+    void unmap(char*& b, size_t bytes)
+    {
+        if (b)
+            munmap(b, bytes);
+        b = nullptr;
+    }
+
+    // Pages still in the pipe keep their own reference, so the old buffers
+    // can go right away.
+    void allocate(size_t pages)
+    {
+        release();
+        bufPages = pages;
+        for (auto& b : bufs)
+        {
+            b = map(pages * pageSize);
+            if (!b)
+            {
+                release();
+                pipeSlots = 0;
+                return;
+            }
+        }
+        used = 0;
+        current = 0;
+        lastUse[1] = spliced - long(pipeSlots);
+    }
+
+    void release()
+    {
+        for (auto& b : bufs)
+            unmap(b, bufPages * pageSize);
+        bufPages = 0;
+    }
+
+    char* beginAsync(size_t maxBytes)
+    {
+#ifdef CLON_URING
+        if (maxBytes > slotBytes)
+        {
+            flush();
+            if (registered)
+                ring.unregisterBuffers();
+            for (auto& b : slots)
+                unmap(b, slotBytes);
+            slotBytes = (maxBytes + pageSize - 1) / pageSize * pageSize;
+            iovec iov[slotCount];
+            for (int i = 0; i < slotCount; ++i)
+            {
+                slots[i] = map(slotBytes);
+                if (!slots[i])
+                {
+                    for (auto& b : slots)
+                        unmap(b, slotBytes);
+                    slotBytes = 0;
+                    async = false;
+                    handOverOffsets(false);
+                    return begin(maxBytes);
+                }
+                iov[i] = {slots[i], slotBytes};
+            }
+            // Registration is an optimisation; without it (e.g. over the
+            // memlock limit) plain writes from the same buffers still work.
+            registered = ring.registerBuffers(iov, slotCount);
+        }
+
+        int s = nextSlot;
+        while (slotRefs[s] > 0)
+            waitAsync();
+        return slots[s];
+#else
+        (void)maxBytes;
+        return nullptr;
+#endif
+    }
+
+    bool commitAsync(size_t n)
+    {
+#ifdef CLON_URING
+        int s = nextSlot;
+        nextSlot = (s + 1) % slotCount;
+        slotLen[s] = n;
+        for (auto& sink : sinks)
+        {
+            sink.queue[sink.queued++] = s;
+            ++slotRefs[s];
+        }
+        progress(0);
+        bool ok = !asyncFailed;
+        asyncFailed = false;
+        return ok;
+#else
+        (void)n;
+        return false;
+#endif
+    }
+
+#ifdef CLON_URING
+    // Queues the next write for every idle sink that has frames waiting.
+    void pump()
+    {
+        for (size_t i = 0; i < sinks.size(); ++i)
+        {
+            if (!sinks[i].inFlight && sinks[i].queued > 0 && !queueWrite(i))
+                return;
+        }
+    }
+
+    bool queueWrite(size_t i)
+    {
+        Sink& sink = sinks[i];
+        io_uring_sqe* sqe = ring.nextSqe();
+        if (!sqe)
+            return false;
+        int s = sink.queue[0];
+        sqe->opcode = registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = sink.fd;
+        sqe->addr = std::uint64_t(slots[s] + sink.sent);
+        sqe->len = unsigned(slotLen[s] - sink.sent);
+        sqe->off = std::uint64_t(sink.offset);
+        sqe->buf_index = std::uint16_t(s);
+        sqe->user_data = i;
+        sink.inFlight = true;
+        ++writes;
+        return true;
+    }
+
+    // io_uring writes regular files at an explicit offset and leaves their
+    // file position alone, while write() only moves the position: pick the
+    // position up when going async and put it back when leaving.
+    void handOverOffsets(bool toRing)
+    {
+        for (Sink& sink : sinks)
+        {
+            if (sink.offset < 0)
+                continue;
+            if (toRing)
+                sink.offset = lseek(sink.fd, 0, SEEK_CUR);
+            else
+                lseek(sink.fd, sink.offset, SEEK_SET);
+        }
+    }
+
+    void complete(const io_uring_cqe& c)
+    {
+        if (c.user_data == pollTag)
+            return;
+        Sink& sink = sinks[c.user_data];
+        sink.inFlight = false;
+        if (c.res == -EAGAIN)
+        {
+            // A non-blocking fd that is full: wait for it in the ring, with
+            // the retried write linked behind the poll.
+            if (io_uring_sqe* sqe = ring.nextSqe())
+            {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = sink.fd;
+                sqe->poll32_events = POLLOUT;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = pollTag;
+                // Without room for the write the link would catch whatever
+                // is queued next; leave the poll alone and let pump() retry.
+                if (!queueWrite(c.user_data))
+                    sqe->flags = 0;
+            }
+            return;
+        }
+        if (c.res == -EINTR)
+            return;
+
+        int s = sink.queue[0];
+        if (c.res > 0)
+        {
+            sink.sent += c.res;
+            if (sink.offset >= 0)
+                sink.offset += c.res;
+            if (sink.sent < slotLen[s])
+                return;
+        }
+
+        // Done, or the sink failed and this frame is dropped for it.
+        if (c.res < 0)
+            asyncFailed = true;
+        std::copy(sink.queue + 1, sink.queue + sink.queued, sink.queue);
+        --sink.queued;
+        sink.sent = 0;
+        --slotRefs[s];
+    }
+
+    void waitAsync()
+    {
+        CLON_ZONE("uring.wait");
+        progress(1);
+    }
+
+    // Submits whatever can go out, optionally waits for a completion, and
+    // follows up on what completed.
+    void progress(unsigned waitFor)
+    {
+        pump();
+        ring.submit(waitFor);
+        ring.reap([&](const io_uring_cqe& c) { complete(c); });
+        pump();
+        ring.submit(0);
+    }
+#endif
+};
+#endif
+
+// Tees presented frames to recordings: an asciicast v2 file holding the
+// exact bytes sent to the terminal with their times, and a raw framebuffer
+// stream for analysis. Raw frames are XORed with the last one written and
+// stored as runs of unchanged pixels and literal pixels:
+//   "CLONFB1\0", u32 width, u32 height, then per frame
+//   u64 microseconds, u32 payload bytes, payload of
+//   (varint unchanged, varint literal count, literal pixels)...
+// Writing happens on a thread of its own. submit copies the frame into one
+// of a few preallocated slots and never waits: with every slot still queued
+// the frame is dropped and counted, and since deltas are taken against the
+// last frame actually written, a dropped frame just goes missing.
+class FrameRecorder
+{
+public:
+    FrameRecorder() = default;
+    FrameRecorder(const FrameRecorder&) = delete;
+    FrameRecorder& operator=(const FrameRecorder&) = delete;
+
+    ~FrameRecorder()
+    {
+        stop();
+    }
+
+    bool openCast(const char* path, int cols, int rows)
+    {
+        cast.open(path, std::ios::binary | std::ios::trunc);
+        cast << "{\"version\": 2, \"width\": " << cols << ", \"height\": " << rows << ", \"timestamp\": "
+            << std::chrono::duration_cast<std::chrono::seconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count()
+            << "}\n";
+        return bool(cast) && start();
+    }
+
+    bool openRaw(const char* path)
+    {
+        raw.open(path, std::ios::binary | std::ios::trunc);
+        std::uint32_t size[2] = {screenW, screenH};
+        raw.write("CLONFB1\0", 8);
+        raw.write(reinterpret_cast<const char*>(size), sizeof(size));
+        return bool(raw) && start();
+    }
+
+    bool isRecording() const
+    {
+        return worker.joinable();
+    }
+
+    // Queues a frame: the bytes that went to the terminal and the pixels
+    // they show. Doesn't block.
+    void submit(std::string_view ansi, const screen& pixels)
+    {
+        int i;
+        if (!worker.joinable() || !freeSlots.pop(i))
+        {
+            dropped += worker.joinable();
+            return;
+        }
+
+        Slot& slot = slots[i];
+        auto now = virtualClock ? virtualTime : std::chrono::steady_clock::now();
+        slot.micros = std::chrono::duration_cast<std::chrono::microseconds>(now - started).count();
+        if (cast.is_open())
+            slot.ansi.assign(ansi);
+        if (raw.is_open())
+            slot.pixels = pixels;
+        filled.push(i);
+        wake.fetch_add(1, std::memory_order_release);
+        wake.notify_one();
+    }
+
+    size_t droppedFrames() const
+    {
+        return dropped;
+    }
+
+    // Writes out what is queued and closes the recordings.
+    void stop()
+    {
+        if (!worker.joinable())
+            return;
+        stopping = true;
+        wake.fetch_add(1, std::memory_order_release);
+        wake.notify_one();
+        worker.join();
+        cast.close();
+        raw.close();
+    }
+
+private:
+    static constexpr int slotCount = 4;
+
+    struct Slot
+    {
+        long long micros = 0;
+        std::string ansi;
+        screen pixels;
+    };
+
+    std::ofstream cast;
+    std::ofstream raw;
+    std::vector<Slot> slots;
+    SpscRing<int, slotCount> filled;
+    SpscRing<int, slotCount> freeSlots;
+    std::atomic<std::uint32_t> wake{0};
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+    std::chrono::steady_clock::time_point started;
+    size_t dropped = 0;
+
+    // Recorder thread only.
+    std::vector<Pixel> previous;
+    std::string out;
+
+    bool start()
+    {
+        if (worker.joinable())
+            return true;
+        slots.resize(slotCount);
+        for (int i = 0; i < slotCount; ++i)
+            freeSlots.push(i);
+        started = virtualClock ? virtualTime : std::chrono::steady_clock::now();
+        worker = std::thread([this] { run(); });
+        return true;
+    }
+
+    void run()
+    {
+        CLON_THREAD_NAME("recorder");
+        for (;;)
+        {
+            auto seen = wake.load(std::memory_order_acquire);
+            int i;
+            if (!filled.pop(i))
+            {
+                if (stopping)
+                    return;
+                wake.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+            CLON_ZONE("record");
+            if (cast.is_open())
+                writeCast(slots[i]);
+            if (raw.is_open())
+                writeRaw(slots[i]);
+            freeSlots.push(i);
+        }
+    }
+
+    void writeCast(const Slot& slot)
+    {
+        out.clear();
+        char head[32];
+        out.append(head, std::snprintf(head, sizeof(head), "[%lld.%06lld, \"o\", \"", slot.micros / 1000000,
+                                       slot.micros % 1000000));
+        for (unsigned char c : slot.ansi)
+        {
+            if (c == '"' || c == '\\')
+            {
+                out.push_back('\\');
+                out.push_back(char(c));
+            }
+            else if (c < 0x20)
+            {
+                char esc[8];
+                out.append(esc, std::snprintf(esc, sizeof(esc), "\\u%04x", c));
+            }
+            else
+                out.push_back(char(c));
+        }
+        out.append("\"]\n");
+        cast.write(out.data(), std::streamsize(out.size()));
+    }
+
+    void writeRaw(const Slot& slot)
+    {
+        const Pixel* now = slot.pixels[0].data();
+        size_t n = size_t(screenW) * screenH;
+        previous.resize(n);
+        out.assign(12, '\0');
+        for (size_t x = 0; x < n;)
+        {
+            size_t same = x;
+            while (same < n && now[same] == previous[same])
+                ++same;
+            size_t diff = same;
+            while (diff < n && now[diff] != previous[diff])
+                ++diff;
+            appendVarint(out, same - x);
+            appendVarint(out, diff - same);
+            for (size_t k = same; k < diff; ++k)
+            {
+                Pixel p = now[k] ^ previous[k];
+                out.append(reinterpret_cast<const char*>(&p), sizeof(p));
+            }
+            x = diff;
+        }
+        std::copy(now, now + n, previous.begin());
+
+        std::uint64_t micros = slot.micros;
+        std::uint32_t bytes = std::uint32_t(out.size() - 12);
+        std::memcpy(out.data(), &micros, sizeof(micros));
+        std::memcpy(out.data() + 8, &bytes, sizeof(bytes));
+        raw.write(out.data(), std::streamsize(out.size()));
+    }
+};
+
+enum class BlendMode
+{
+    Over,
+    Add,
+    Multiply,
+    Screen
+};
+
+inline Pixel premultiplyColor(Color c)
+{
+    auto mul = [a = unsigned(c.a)](unsigned v)
+    {
+        unsigned t = v * a + 128;
+        return (t + (t >> 8)) >> 8;
+    };
+    return Pixel(c.a) << 24 | Pixel(mul(c.r)) << 16 | Pixel(mul(c.g)) << 8 | Pixel(mul(c.b));
+}
+
+inline void premultiplySurface(Surface& s)
+{
+    for (int y = 0; y < s.height(); ++y)
+    {
+        Pixel* row = s.row(y);
+        for (int x = 0; x < s.width(); ++x)
+        {
+            Pixel p = row[x];
+            row[x] = premultiplyColor({(unsigned char)(p >> 16), (unsigned char)(p >> 8),
+                                       (unsigned char)p, (unsigned char)(p >> 24)});
+        }
+    }
+}
+
+// sRGB <-> linear light tables for gamma-correct compositing. Linear values
+// are kept at 12 bits so dark gradients don't band after the round trip.
+struct GammaLut
+{
+    std::array<std::uint16_t, 256> toLinear;
+    std::array<std::uint8_t, 4096> toSrgb;
+};
+
+inline const GammaLut& gammaLut()
+{
+    static const GammaLut lut = []
+    {
+        GammaLut l{};
+        for (int i = 0; i < 256; ++i)
+        {
+            double c = i / 255.0;
+            double lin = c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+            l.toLinear[i] = std::uint16_t(std::lround(lin * 4095.0));
+        }
+        for (int i = 0; i < 4096; ++i)
+        {
+            double lin = i / 4095.0;
+            double c = lin <= 0.0031308 ? lin * 12.92 : 1.055 * std::pow(lin, 1 / 2.4) - 0.055;
+            l.toSrgb[i] = std::uint8_t(std::lround(c * 255.0));
+        }
+        return l;
+    }();
+    return lut;
+}
+
+// Scalar reference for one premultiplied channel; a and b share a scale of
+// `one` (255 for sRGB bytes, 4095 for linear values).
+inline unsigned blendChannel(unsigned s, unsigned d, unsigned sa, unsigned da, unsigned one,
+                             BlendMode mode)
+{
+    auto mul = [one](unsigned x, unsigned y) { return (x * y + one / 2) / one; };
+    unsigned r = 0;
+    switch (mode)
+    {
+    case BlendMode::Over: r = s + mul(d, one - sa);
+        break;
+    case BlendMode::Add: r = s + d;
+        break;
+    case BlendMode::Multiply: r = mul(s, d) + mul(s, one - da) + mul(d, one - sa);
+        break;
+    case BlendMode::Screen: r = s + d - mul(s, d);
+        break;
+    }
+    return std::min(r, one);
+}
+
+// Composites premultiplied src onto premultiplied dst. The byte path works in
+// sRGB space; gammaCorrect blends in linear light instead, which is slower
+// but keeps translucent edges from darkening. Premultiplying doesn't commute
+// with the transfer curve, so colours are unpremultiplied before going
+// through the LUTs and premultiplied again by alpha in linear light.
+inline void compositeSpan(Pixel* dst, const Pixel* src, int n, BlendMode mode,
+                          bool gammaCorrect = false)
+{
+    int i = 0;
+    if (gammaCorrect)
+    {
+        const GammaLut& lut = gammaLut();
+        // Premultiplied sRGB byte <-> premultiplied linear value.
+        auto decode = [&](unsigned c, unsigned a)
+        {
+            if (a == 0)
+                return 0u;
+            unsigned straight = std::min(255u, (c * 255 + a / 2) / a);
+            return (lut.toLinear[straight] * a + 127) / 255;
+        };
+        auto encode = [&](unsigned lin, unsigned a)
+        {
+            if (a == 0)
+                return 0u;
+            unsigned straight = std::min(4095u, (lin * 255 + a / 2) / a);
+            return (lut.toSrgb[straight] * a + 127) / 255;
+        };
+
+        for (; i < n; ++i)
+        {
+            Pixel s = src[i];
+            Pixel d = dst[i];
+            unsigned sa = s >> 24;
+            unsigned da = d >> 24;
+            unsigned oa = blendChannel(sa, da, sa, da, 255, mode);
+            Pixel out = Pixel(oa) << 24;
+            unsigned saLin = (sa * 4095 + 127) / 255;
+            unsigned daLin = (da * 4095 + 127) / 255;
+            for (int shift = 0; shift < 24; shift += 8)
+            {
+                unsigned c = blendChannel(decode((s >> shift) & 0xFF, sa),
+                                          decode((d >> shift) & 0xFF, da),
+                                          saLin, daLin, 4095, mode);
+                out |= Pixel(encode(c, oa)) << shift;
+            }
+            dst[i] = out;
+        }
+        return;
+    }
+
+#ifdef CLON_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i round = _mm_set1_epi16(128);
+
+    auto mul = [&](__m128i x, __m128i y)
+    {
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), round);
+        return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    };
+    auto alpha = [](__m128i v)
+    {
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+        return _mm_shufflehi_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+    };
+    auto blend2 = [&](__m128i s, __m128i d)
+    {
+        switch (mode)
+        {
+        case BlendMode::Over:
+            return _mm_add_epi16(s, mul(d, _mm_sub_epi16(full, alpha(s))));
+        case BlendMode::Multiply:
+            return _mm_add_epi16(mul(s, d),
+                                 _mm_add_epi16(mul(s, _mm_sub_epi16(full, alpha(d))),
+                                               mul(d, _mm_sub_epi16(full, alpha(s)))));
+        case BlendMode::Screen:
+            return _mm_sub_epi16(_mm_add_epi16(s, d), mul(s, d));
+        default:
+            return _mm_add_epi16(s, d);
+        }
+    };
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i out;
+        if (mode == BlendMode::Add)
+            out = _mm_adds_epu8(s, d);
+        else
+        {
+            __m128i lo = blend2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+            __m128i hi = blend2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+            out = _mm_packus_epi16(lo, hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+#endif
+    for (; i < n; ++i)
+    {
+        Pixel s = src[i];
+        Pixel d = dst[i];
+        unsigned sa = s >> 24;
+        unsigned da = d >> 24;
+        Pixel out = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+            out |= Pixel(blendChannel((s >> shift) & 0xFF, (d >> shift) & 0xFF, sa, da, 255, mode))
+                << shift;
+        dst[i] = out;
+    }
+}
+
+inline Rect intersect(Rect a, Rect b)
+{
+    int x0 = std::max(a.x, b.x);
+    int y0 = std::max(a.y, b.y);
+    int x1 = std::min(a.x + a.w, b.x + b.w);
+    int y1 = std::min(a.y + a.h, b.y + b.h);
+    return {x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0)};
+}
+
+inline Rect unite(Rect a, Rect b)
+{
+    int x0 = std::min(a.x, b.x);
+    int y0 = std::min(a.y, b.y);
+    int x1 = std::max(a.x + a.w, b.x + b.w);
+    int y1 = std::max(a.y + a.h, b.y + b.h);
+    return {x0, y0, x1 - x0, y1 - y0};
+}
+
+// Scales a premultiplied span by opacity (0-255) into out.
+inline void fadeSpan(Pixel* out, const Pixel* src, int n, unsigned opacity)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        Pixel p = src[i];
+        Pixel r = 0;
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            unsigned t = ((p >> shift) & 0xFF) * opacity + 128;
+            r |= Pixel((t + (t >> 8)) >> 8) << shift;
+        }
+        out[i] = r;
+    }
+}
+
+// A premultiplied surface placed on screen by a LayerStack. Drawing into
+// pixels() must be followed by markDirty so the stack knows what to redo.
+class Layer
+{
+public:
+    Layer(int width, int height)
+        : surface(width, height)
+    {
+        markDirty();
+    }
+
+    Surface& pixels() { return surface; }
+    const Surface& pixels() const { return surface; }
+
+    Rect bounds() const { return {x, y, surface.width(), surface.height()}; }
+    bool isVisible() const { return visible; }
+    unsigned char opacity() const { return alpha; }
+
+    // r is in layer coordinates.
+    void markDirty(Rect r)
+    {
+        r = intersect({0, 0, surface.width(), surface.height()}, r);
+        if (r.w > 0 && r.h > 0)
+            dirty.push_back({r.x + x, r.y + y, r.w, r.h});
+    }
+
+    void markDirty()
+    {
+        dirty.push_back(bounds());
+    }
+
+    void setVisible(bool v)
+    {
+        if (v != visible)
+            markDirty();
+        visible = v;
+    }
+
+    void setOpacity(unsigned char a)
+    {
+        if (a != alpha)
+            markDirty();
+        alpha = a;
+    }
+
+    void setOffset(int nx, int ny)
+    {
+        if (nx == x && ny == y)
+            return;
+        markDirty();
+        x = nx;
+        y = ny;
+        markDirty();
+    }
+
+private:
+    friend class LayerStack;
+
+    Surface surface;
+    int x = 0;
+    int y = 0;
+    bool visible = true;
+    unsigned char alpha = 255;
+    std::vector<Rect> dirty;
+};
+
+// Ordered layers (first added is bottom) composited over a background
+// colour. Only the screen regions some layer marked dirty are rebuilt.
+class LayerStack
+{
+public:
+    Layer& add(int width, int height)
+    {
+        return layers.emplace_back(width, height);
+    }
+
+    bool empty() const { return layers.empty(); }
+
+    void setBackground(Color c)
+    {
+        background = compactColor(c);
+        everything = true;
+    }
+
+    // Returns true if any pixel of target was rewritten.
+    bool composite(screen& target)
+    {
+        CLON_ZONE("composite");
+        if (layers.empty())
+            return false;
+
+        std::vector<Rect> regions;
+        if (everything)
+            regions.push_back({0, 0, screenW, screenH});
+        for (auto& layer : layers)
+        {
+            if (!everything)
+                regions.insert(regions.end(), layer.dirty.begin(), layer.dirty.end());
+            layer.dirty.clear();
+        }
+        everything = false;
+
+        mergeRegions(regions);
+        for (Rect r : regions)
+            compositeRegion(target, r);
+        return !regions.empty();
+    }
+
+private:
+    std::deque<Layer> layers;
+    Pixel background = compactColor({0, 0, 0});
+    bool everything = true;
+    std::vector<Pixel> scratch;
+
+    // Clips to the screen and folds overlapping rects together so no pixel
+    // is composited twice in one frame.
+    static void mergeRegions(std::vector<Rect>& regions)
+    {
+        for (auto& r : regions)
+            r = intersect(r, {0, 0, screenW, screenH});
+        std::erase_if(regions, [](Rect r) { return r.w <= 0 || r.h <= 0; });
+
+        for (bool merged = true; merged;)
+        {
+            merged = false;
+            for (size_t i = 0; i < regions.size() && !merged; ++i)
+            {
+                for (size_t j = i + 1; j < regions.size(); ++j)
+                {
+                    Rect o = intersect(regions[i], regions[j]);
+                    if (o.w > 0 && o.h > 0)
+                    {
+                        regions[i] = unite(regions[i], regions[j]);
+                        regions.erase(regions.begin() + j);
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    void compositeRegion(screen& target, Rect r)
+    {
+        for (int y = r.y; y < r.y + r.h; ++y)
+            std::fill_n(target[y].data() + r.x, r.w, background);
+
+        for (const auto& layer : layers)
+        {
+            if (!layer.visible || layer.alpha == 0)
+                continue;
+            Rect o = intersect(r, layer.bounds());
+            if (o.w <= 0 || o.h <= 0)
+                continue;
+
+            scratch.resize(o.w);
+            for (int y = o.y; y < o.y + o.h; ++y)
+            {
+                const Pixel* src = layer.surface.row(y - layer.y) + (o.x - layer.x);
+                if (layer.alpha != 255)
+                {
+                    fadeSpan(scratch.data(), src, o.w, layer.alpha);
+                    src = scratch.data();
+                }
+                compositeSpan(target[y].data() + o.x, src, o.w, BlendMode::Over);
+            }
+        }
+    }
+};
+
+// Decodes one code point at s[i] and advances i; malformed input yields
+// U+FFFD and skips a single byte.
+inline char32_t decodeUtf8(std::string_view s, size_t& i)
+{
+    auto c = static_cast<unsigned char>(s[i++]);
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    if (c >= 0x80 && extra == 0)
+        return 0xFFFD;
+
+    char32_t cp = extra ? c & (0x3F >> extra) : c;
+    if (i + extra > s.size())
+        return 0xFFFD;
+    for (int k = 0; k < extra; ++k)
+    {
+        auto cc = static_cast<unsigned char>(s[i + k]);
+        if ((cc & 0xC0) != 0x80)
+            return 0xFFFD;
+        cp = cp << 6 | (cc & 0x3F);
+    }
+    i += extra;
+    return cp;
+}
+
+// 5x7 ASCII glyphs in 6x8 cells, one byte per row, leftmost pixel in bit 7
+// (the same layout PSF fonts use).
+constexpr std::uint8_t builtinGlyphs[95 * 8] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // ' '
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x00, 0x20, 0x00, // '!'
+    0x50, 0x50, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, // '"'
+    0x50, 0x50, 0xF8, 0x50, 0xF8, 0x50, 0x50, 0x00, // '#'
+    0x20, 0x78, 0xA0, 0x70, 0x28, 0xF0, 0x20, 0x00, // '$'
+    0xC0, 0xC8, 0x10, 0x20, 0x40, 0x98, 0x18, 0x00, // '%'
+    0x60, 0x90, 0xA0, 0x40, 0xA8, 0x90, 0x68, 0x00, // '&'
+    0x20, 0x20, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, // "'"
+    0x10, 0x20, 0x40, 0x40, 0x40, 0x20, 0x10, 0x00, // '('
+    0x40, 0x20, 0x10, 0x10, 0x10, 0x20, 0x40, 0x00, // ')'
+    0x00, 0x20, 0xA8, 0x70, 0xA8, 0x20, 0x00, 0x00, // '*'
+    0x00, 0x20, 0x20, 0xF8, 0x20, 0x20, 0x00, 0x00, // '+'
+    0x00, 0x00, 0x00, 0x00, 0x60, 0x20, 0x40, 0x00, // ','
+    0x00, 0x00, 0x00, 0xF8, 0x00, 0x00, 0x00, 0x00, // '-'
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x60, 0x00, // '.'
+    0x00, 0x08, 0x10, 0x20, 0x40, 0x80, 0x00, 0x00, // '/'
+    0x70, 0x88, 0x98, 0xA8, 0xC8, 0x88, 0x70, 0x00, // '0'
+    0x20, 0x60, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00, // '1'
+    0x70, 0x88, 0x08, 0x10, 0x20, 0x40, 0xF8, 0x00, // '2'
+    0xF8, 0x10, 0x20, 0x10, 0x08, 0x88, 0x70, 0x00, // '3'
+    0x10, 0x30, 0x50, 0x90, 0xF8, 0x10, 0x10, 0x00, // '4'
+    0xF8, 0x80, 0xF0, 0x08, 0x08, 0x88, 0x70, 0x00, // '5'
+    0x30, 0x40, 0x80, 0xF0, 0x88, 0x88, 0x70, 0x00, // '6'
+    0xF8, 0x08, 0x10, 0x20, 0x40, 0x40, 0x40, 0x00, // '7'
+    0x70, 0x88, 0x88, 0x70, 0x88, 0x88, 0x70, 0x00, // '8'
+    0x70, 0x88, 0x88, 0x78, 0x08, 0x10, 0x60, 0x00, // '9'
+    0x00, 0x60, 0x60, 0x00, 0x60, 0x60, 0x00, 0x00, // ':'
+    0x00, 0x60, 0x60, 0x00, 0x60, 0x20, 0x40, 0x00, // ';'
+    0x10, 0x20, 0x40, 0x80, 0x40, 0x20, 0x10, 0x00, // '<'
+    0x00, 0x00, 0xF8, 0x00, 0xF8, 0x00, 0x00, 0x00, // '='
+    0x40, 0x20, 0x10, 0x08, 0x10, 0x20, 0x40, 0x00, // '>'
+    0x70, 0x88, 0x08, 0x10, 0x20, 0x00, 0x20, 0x00, // '?'
+    0x70, 0x88, 0x08, 0x68, 0xA8, 0xA8, 0x70, 0x00, // '@'
+    0x70, 0x88, 0x88, 0xF8, 0x88, 0x88, 0x88, 0x00, // 'A'
+    0xF0, 0x88, 0x88, 0xF0, 0x88, 0x88, 0xF0, 0x00, // 'B'
+    0x70, 0x88, 0x80, 0x80, 0x80, 0x88, 0x70, 0x00, // 'C'
+    0xE0, 0x90, 0x88, 0x88, 0x88, 0x90, 0xE0, 0x00, // 'D'
+    0xF8, 0x80, 0x80, 0xF0, 0x80, 0x80, 0xF8, 0x00, // 'E'
+    0xF8, 0x80, 0x80, 0xF0, 0x80, 0x80, 0x80, 0x00, // 'F'
+    0x70, 0x88, 0x80, 0xB8, 0x88, 0x88, 0x78, 0x00, // 'G'
+    0x88, 0x88, 0x88, 0xF8, 0x88, 0x88, 0x88, 0x00, // 'H'
+    0x70, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00, // 'I'
+    0x38, 0x10, 0x10, 0x10, 0x10, 0x90, 0x60, 0x00, // 'J'
+    0x88, 0x90, 0xA0, 0xC0, 0xA0, 0x90, 0x88, 0x00, // 'K'
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0xF8, 0x00, // 'L'
+    0x88, 0xD8, 0xA8, 0xA8, 0x88, 0x88, 0x88, 0x00, // 'M'
+    0x88, 0x88, 0xC8, 0xA8, 0x98, 0x88, 0x88, 0x00, // 'N'
+    0x70, 0x88, 0x88, 0x88, 0x88, 0x88, 0x70, 0x00, // 'O'
+    0xF0, 0x88, 0x88, 0xF0, 0x80, 0x80, 0x80, 0x00, // 'P'
+    0x70, 0x88, 0x88, 0x88, 0xA8, 0x90, 0x68, 0x00, // 'Q'
+    0xF0, 0x88, 0x88, 0xF0, 0xA0, 0x90, 0x88, 0x00, // 'R'
+    0x78, 0x80, 0x80, 0x70, 0x08, 0x08, 0xF0, 0x00, // 'S'
+    0xF8, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, // 'T'
+    0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x70, 0x00, // 'U'
+    0x88, 0x88, 0x88, 0x88, 0x88, 0x50, 0x20, 0x00, // 'V'
+    0x88, 0x88, 0x88, 0xA8, 0xA8, 0xA8, 0x50, 0x00, // 'W'
+    0x88, 0x88, 0x50, 0x20, 0x50, 0x88, 0x88, 0x00, // 'X'
+    0x88, 0x88, 0x88, 0x50, 0x20, 0x20, 0x20, 0x00, // 'Y'
+    0xF8, 0x08, 0x10, 0x20, 0x40, 0x80, 0xF8, 0x00, // 'Z'
+    0x70, 0x40, 0x40, 0x40, 0x40, 0x40, 0x70, 0x00, // '['
+    0x00, 0x80, 0x40, 0x20, 0x10, 0x08, 0x00, 0x00, // '\\'
+    0x70, 0x10, 0x10, 0x10, 0x10, 0x10, 0x70, 0x00, // ']'
+    0x20, 0x50, 0x88, 0x00, 0x00, 0x00, 0x00, 0x00, // '^'
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xF8, 0x00, // '_'
+    0x40, 0x20, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, // '`'
+    0x00, 0x00, 0x70, 0x08, 0x78, 0x88, 0x78, 0x00, // 'a'
+    0x80, 0x80, 0xB0, 0xC8, 0x88, 0x88, 0xF0, 0x00, // 'b'
+    0x00, 0x00, 0x70, 0x80, 0x80, 0x88, 0x70, 0x00, // 'c'
+    0x08, 0x08, 0x68, 0x98, 0x88, 0x88, 0x78, 0x00, // 'd'
+    0x00, 0x00, 0x70, 0x88, 0xF8, 0x80, 0x70, 0x00, // 'e'
+    0x30, 0x48, 0x40, 0xE0, 0x40, 0x40, 0x40, 0x00, // 'f'
+    0x00, 0x78, 0x88, 0x88, 0x78, 0x08, 0x70, 0x00, // 'g'
+    0x80, 0x80, 0xB0, 0xC8, 0x88, 0x88, 0x88, 0x00, // 'h'
+    0x20, 0x00, 0x60, 0x20, 0x20, 0x20, 0x70, 0x00, // 'i'
+    0x10, 0x00, 0x30, 0x10, 0x10, 0x90, 0x60, 0x00, // 'j'
+    0x80, 0x80, 0x90, 0xA0, 0xC0, 0xA0, 0x90, 0x00, // 'k'
+    0x60, 0x20, 0x20, 0x20, 0x20, 0x20, 0x70, 0x00, // 'l'
+    0x00, 0x00, 0xD0, 0xA8, 0xA8, 0x88, 0x88, 0x00, // 'm'
+    0x00, 0x00, 0xB0, 0xC8, 0x88, 0x88, 0x88, 0x00, // 'n'
+    0x00, 0x00, 0x70, 0x88, 0x88, 0x88, 0x70, 0x00, // 'o'
+    0x00, 0x00, 0xF0, 0x88, 0xF0, 0x80, 0x80, 0x00, // 'p'
+    0x00, 0x00, 0x68, 0x98, 0x78, 0x08, 0x08, 0x00, // 'q'
+    0x00, 0x00, 0xB0, 0xC8, 0x80, 0x80, 0x80, 0x00, // 'r'
+    0x00, 0x00, 0x70, 0x80, 0x70, 0x08, 0xF0, 0x00, // 's'
+    0x40, 0x40, 0xE0, 0x40, 0x40, 0x48, 0x30, 0x00, // 't'
+    0x00, 0x00, 0x88, 0x88, 0x88, 0x98, 0x68, 0x00, // 'u'
+    0x00, 0x00, 0x88, 0x88, 0x88, 0x50, 0x20, 0x00, // 'v'
+    0x00, 0x00, 0x88, 0x88, 0xA8, 0xA8, 0x50, 0x00, // 'w'
+    0x00, 0x00, 0x88, 0x50, 0x20, 0x50, 0x88, 0x00, // 'x'
+    0x00, 0x00, 0x88, 0x88, 0x78, 0x08, 0x70, 0x00, // 'y'
+    0x00, 0x00, 0xF8, 0x10, 0x20, 0x40, 0xF8, 0x00, // 'z'
+    0x10, 0x20, 0x20, 0x40, 0x20, 0x20, 0x10, 0x00, // '{'
+    0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x00, // '|'
+    0x40, 0x20, 0x20, 0x10, 0x20, 0x20, 0x40, 0x00, // '}'
+    0x00, 0x00, 0x40, 0xA8, 0x10, 0x00, 0x00, 0x00, // '~'
+};
+
+// Monochrome bitmap font. Glyphs are expanded into coloured surfaces the
+// first time a (glyph, colour) pair is drawn, so drawing text afterwards is
+// one keyed span blit per glyph row.
+class BitmapFont
+{
+public:
+    static const BitmapFont& builtin()
+    {
+        static const BitmapFont font = []
+        {
+            BitmapFont f;
+            f.w = 6;
+            f.h = 8;
+            f.stride = 1;
+            f.bitmap.assign(std::begin(builtinGlyphs), std::end(builtinGlyphs));
+            for (char32_t c = 32; c < 127; ++c)
+                f.index[c] = int(c - 32);
+            return f;
+        }();
+        return font;
+    }
+
+    // Loads a PSF1 or PSF2 console font, including its unicode table if it
+    // has one; fonts without a table map glyph n to code point n.
+    bool loadPsf(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        auto u8 = [&](size_t at) { return static_cast<unsigned char>(data[at]); };
+        auto u32 = [&](size_t at)
+        {
+            return std::uint32_t(u8(at)) | std::uint32_t(u8(at + 1)) << 8 |
+                std::uint32_t(u8(at + 2)) << 16 | std::uint32_t(u8(at + 3)) << 24;
+        };
+
+        size_t header, count, glyphBytes;
+        bool hasTable;
+        bool psf2 = false;
+        if (data.size() >= 4 && u8(0) == 0x36 && u8(1) == 0x04)
+        {
+            header = 4;
+            count = (u8(2) & 1) ? 512 : 256;
+            hasTable = u8(2) & 2;
+            glyphBytes = u8(3);
+            w = 8;
+            h = int(glyphBytes);
+        }
+        else if (data.size() >= 32 && u32(0) == 0x864AB572)
+        {
+            psf2 = true;
+            header = u32(8);
+            hasTable = u32(12) & 1;
+            count = u32(16);
+            glyphBytes = u32(20);
+            h = int(u32(24));
+            w = int(u32(28));
+        }
+        else
+            return false;
+
+        stride = (w + 7) / 8;
+        if (w <= 0 || h <= 0 || glyphBytes < size_t(stride) * h ||
+            data.size() < header + count * glyphBytes)
+            return false;
+
+        bitmap.clear();
+        for (size_t g = 0; g < count; ++g)
+            bitmap.append(data, header + g * glyphBytes, size_t(stride) * h);
+        index.clear();
+        cache.clear();
+
+        size_t at = header + count * glyphBytes;
+        if (!hasTable)
+        {
+            for (size_t g = 0; g < count; ++g)
+                index[char32_t(g)] = int(g);
+            return true;
+        }
+
+        // Each glyph lists its code points, then optional combining
+        // sequences (which we skip), then a terminator.
+        for (size_t g = 0; g < count && at < data.size(); ++g)
+        {
+            bool sequence = false;
+            while (at < data.size())
+            {
+                if (psf2)
+                {
+                    unsigned char c = u8(at);
+                    if (c == 0xFF) { ++at; break; }
+                    if (c == 0xFE) { sequence = true; ++at; continue; }
+                    char32_t cp = decodeUtf8(data, at);
+                    if (!sequence)
+                        index.emplace(cp, int(g));
+                }
+                else
+                {
+                    if (at + 1 >= data.size())
+                        break;
+                    unsigned cp = u8(at) | u8(at + 1) << 8;
+                    at += 2;
+                    if (cp == 0xFFFF) break;
+                    if (cp == 0xFFFE) { sequence = true; continue; }
+                    if (!sequence)
+                        index.emplace(char32_t(cp), int(g));
+                }
+            }
+        }
+        return true;
+    }
+
+    int width() const { return w; }
+    int height() const { return h; }
+
+    // Falls back to '?' and then to glyph 0 for unmapped code points.
+    int glyphIndex(char32_t cp) const
+    {
+        if (auto it = index.find(cp); it != index.end())
+            return it->second;
+        if (auto it = index.find(U'?'); it != index.end())
+            return it->second;
+        return 0;
+    }
+
+    bool bit(int glyph, int x, int y) const
+    {
+        auto b = static_cast<unsigned char>(bitmap[(size_t(glyph) * h + y) * stride + x / 8]);
+        return b & (0x80 >> (x % 8));
+    }
+
+    // The glyph drawn in `color` on a background of `color ^ 0xFFFFFF`, which
+    // is the key to skip when blitting.
+    const Surface& glyph(int g, Pixel color) const
+    {
+        std::uint64_t key = std::uint64_t(g) << 32 | color;
+        if (auto it = cache.find(key); it != cache.end())
+            return it->second;
+
+        if (cache.size() >= 4096)
+            cache.clear();
+
+        Pixel bg = color ^ 0x00FFFFFF;
+        Surface s(w, h);
+        for (int y = 0; y < h; ++y)
+        {
+            Pixel* row = s.row(y);
+            for (int x = 0; x < w; ++x)
+                row[x] = bit(g, x, y) ? color : bg;
+        }
+        return cache.emplace(key, std::move(s)).first->second;
+    }
+
+private:
+    int w = 0;
+    int h = 0;
+    int stride = 0;
+    std::string bitmap;
+    std::unordered_map<char32_t, int> index;
+    mutable std::unordered_map<std::uint64_t, Surface> cache;
+};
+
+constexpr int cellsW = screenW;
+constexpr int cellsH = screenH / 2;
+
+// A terminal cell that shows a real character instead of the two pixels
+// underneath it. ch == 0 means the cell shows pixels. Only single-width
+// characters line up with the pixel grid.
+struct TextCell
+{
+    char32_t ch = 0;
+    Pixel fg = 0;
+    Pixel bg = 0;
+};
+
+using cellGrid = std::vector<TextCell>;
+
+// Positional 64-bit hash in the style of XXH3's accumulate loop: every
+// 16-byte block is xored with a key that advances per block and folded in
+// with 32x32->64 bit multiplies, so SSE2 hashes two lanes per instruction.
+// The scalar loop computes the same value.
+inline std::uint64_t hashBytes(const void* data, size_t n, std::uint64_t seed)
+{
+    const auto* p = static_cast<const unsigned char*>(data);
+    std::uint64_t acc[2] = {seed ^ 0x9E3779B185EBCA87, seed + 0xC2B2AE3D27D4EB4F};
+    std::uint64_t key[2] = {0x165667B19E3779F9, 0x27D4EB2F165667C5};
+    const std::uint64_t step[2] = {0x9E3779B97F4A7C15, 0xBF58476D1CE4E5B9};
+    size_t i = 0;
+
+#ifdef CLON_SSE2
+    if (n >= 16)
+    {
+        __m128i accV = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc));
+        __m128i keyV = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+        const __m128i stepV = _mm_loadu_si128(reinterpret_cast<const __m128i*>(step));
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            __m128i dk = _mm_xor_si128(d, keyV);
+            __m128i prod = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(2, 3, 0, 1)));
+            accV = _mm_add_epi64(accV, _mm_add_epi64(prod, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2))));
+            keyV = _mm_add_epi64(keyV, stepV);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), accV);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(key), keyV);
+    }
+#endif
+
+    auto round = [&](const unsigned char* block)
+    {
+        std::uint64_t d[2];
+        std::memcpy(d, block, 16);
+        std::uint64_t k0 = d[0] ^ key[0];
+        std::uint64_t k1 = d[1] ^ key[1];
+        acc[0] += (k0 & 0xFFFFFFFF) * (k0 >> 32) + d[1];
+        acc[1] += (k1 & 0xFFFFFFFF) * (k1 >> 32) + d[0];
+        key[0] += step[0];
+        key[1] += step[1];
+    };
+    for (; i + 16 <= n; i += 16)
+        round(p + i);
+    if (i < n)
+    {
+        unsigned char tail[16] = {};
+        std::memcpy(tail, p + i, n - i);
+        round(tail);
+    }
+
+    std::uint64_t h = acc[0] ^ (acc[1] << 29 | acc[1] >> 35) ^ n;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCD;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53;
+    h ^= h >> 33;
+    return h;
+}
+
+constexpr int decimalDigits(int v)
+{
+    return v >= 100 ? 3 : v >= 10 ? 2 : 1;
+}
+
+// Decimal strings for 0-999 followed by ';', padded to four bytes so each is
+// written with a single unaligned store. len counts the digits and the ';'.
+struct DecimalTable
+{
+    std::array<std::array<char, 4>, 1000> text;
+    std::array<std::uint8_t, 1000> len;
+};
+
+constexpr DecimalTable decimalTable = []
+{
+    DecimalTable t{};
+    for (int v = 0; v < 1000; ++v)
+    {
+        int n = decimalDigits(v);
+        for (int i = n - 1, x = v; i >= 0; --i, x /= 10)
+            t.text[v][i] = char('0' + x % 10);
+        t.text[v][n] = ';';
+        t.len[v] = std::uint8_t(n + 1);
+    }
+    return t;
+}();
+
+// Writes a fixed string with one store of N - 1 bytes (the literal minus its
+// terminator); callers must leave room for the full literal.
+template <size_t N>
+inline void putLiteral(char*& p, const char (&s)[N])
+{
+    std::memcpy(p, s, N);
+    p += N - 1;
+}
+
+// Writes "v;" and advances past it.
+inline void putField(char*& p, int v)
+{
+    std::memcpy(p, decimalTable.text[v].data(), 4);
+    p += decimalTable.len[v];
+}
+
+// Writes "v" and advances past it; the byte after it is clobbered.
+inline void putDecimal(char*& p, int v)
+{
+    std::memcpy(p, decimalTable.text[v].data(), 4);
+    p += decimalTable.len[v] - 1;
+}
+
+// What the terminal shows in one cell: the half block in fg over bg, or the
+// text character ch. Colours are stored without alpha.
+struct CellState
+{
+    Pixel bg;
+    Pixel fg;
+    char32_t ch;
+    bool known = true; // false until the encoder has drawn the cell
+
+    bool operator==(const CellState&) const = default;
+};
+
+inline int glyphBytes(char32_t ch)
+{
+    if (ch == 0)
+        return 3; // "▄"
+    return ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+}
+
+// Lossy colour settings. Channels are cut to `bits` before cells are compared
+// or emitted, and with maxDeltaE > 0 a cell whose colours are within that
+// OKLab distance of what is shown (or of the current SGR colours), with no
+// channel more than two of those steps off, is left as is. Fewer distinct
+// colours means fewer escape sequences.
+struct ColorQuality
+{
+    int bits = 8;
+    float maxDeltaE = 0;
+};
+
+// From exact to coarsest; bandwidth adaptation walks this list.
+inline constexpr ColorQuality qualityLevels[] = {
+    {8, 0.0f},
+    {6, 0.0f},
+    {5, 0.0f},
+    {5, 0.02f},
+    {4, 0.03f},
+};
+
+// Which cells an encode may update. Interlaced modes refresh half of the
+// cells per frame, alternating rows or a checkerboard, so each frame costs
+// about half the bytes and a still image is complete after two frames.
+enum class Interlace
+{
+    Off,
+    Rows,
+    Checkerboard,
+};
+
+struct Oklab
+{
+    float l, a, b;
+};
+
+inline Oklab toOklab(Pixel c)
+{
+    const GammaLut& lut = gammaLut();
+    float r = lut.toLinear[(c >> 16) & 0xFF] / 4095.0f;
+    float g = lut.toLinear[(c >> 8) & 0xFF] / 4095.0f;
+    float b = lut.toLinear[c & 0xFF] / 4095.0f;
+
+    float l = std::cbrt(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float m = std::cbrt(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float s = std::cbrt(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+    return {
+        0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+        1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+        0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s,
+    };
+}
+
+// Nearest entry of the xterm 256-colour palette, from the 6x6x6 cube
+// (16-231) or the grey ramp (232-255).
+inline int xtermIndex(Pixel c)
+{
+    int r = (c >> 16) & 0xFF, g = (c >> 8) & 0xFF, b = c & 0xFF;
+    auto level = [](int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+    auto value = [](int i) { return i ? 55 + 40 * i : 0; };
+    auto dist = [&](int x, int y, int z) { return (r - x) * (r - x) + (g - y) * (g - y) + (b - z) * (b - z); };
+
+    int ri = level(r), gi = level(g), bi = level(b);
+    int cubeDist = dist(value(ri), value(gi), value(bi));
+
+    int avg = (r + g + b) / 3;
+    int grey = avg < 8 ? 0 : avg > 238 ? 23 : (avg - 3) / 10;
+    int greyV = 8 + 10 * grey;
+
+    return dist(greyV, greyV, greyV) < cubeDist ? 232 + grey : 16 + 36 * ri + 6 * gi + bi;
+}
+
+inline Pixel xtermColor(int index)
+{
+    if (index >= 232)
+        return 0x010101 * Pixel(8 + 10 * (index - 232));
+    index -= 16;
+    auto value = [](int i) { return Pixel(i ? 55 + 40 * i : 0); };
+    return value(index / 36) << 16 | value(index / 6 % 6) << 8 | value(index % 6);
+}
+
+// Turns frames into the escape sequences that bring the terminal from the
+// previously encoded frame to the new one. Only changed cells are written,
+// and the cursor is moved between them by whichever of CUP, CUF/CUB, a line
+// feed or re-emitting the cells in between costs the fewest bytes.
+class TerminalEncoder
+{
+public:
+    // Forces the next encode to repaint every cell, e.g. after something
+    // else has written to the terminal.
+    void invalidate()
+    {
+        shown.clear();
+    }
+
+    void setCaps(TerminalCaps c)
+    {
+        caps = c;
+    }
+
+    void setQuality(ColorQuality q)
+    {
+        quality = q;
+        int bits = std::clamp(q.bits, 1, 8);
+        quantMask = 0x010101 * ((0xFF << (8 - bits)) & 0xFF);
+        maxChannelError = 2 << (8 - bits);
+        for (int v = 0; v < 256; ++v)
+        {
+            int high = v >> (8 - bits);
+            int out = 0;
+            for (int shift = 8 - bits; shift > -bits; shift -= bits)
+                out |= shift >= 0 ? high << shift : high >> -shift;
+            quantLevels[v] = std::uint8_t(out);
+        }
+        recheckAll();
+    }
+
+    ColorQuality colorQuality() const
+    {
+        return quality;
+    }
+
+    // Caps the bytes a single encode may produce (0 = unlimited); changes
+    // that don't fit are carried into the following encodes.
+    void setByteBudget(size_t bytes)
+    {
+        byteBudget = bytes;
+    }
+
+    // Cells in this rect (in cell coordinates) are refined first when a
+    // frame has to be split across the budget.
+    void setFocus(Rect cells)
+    {
+        focus = cells;
+    }
+
+    // Emits 256-colour SGRs ("48;5;n") instead of truecolor, which roughly
+    // halves the size of every colour change.
+    void setPalette256(bool on)
+    {
+        if (on != palette256)
+            recheckAll();
+        palette256 = on;
+    }
+
+    void setInterlace(Interlace mode)
+    {
+        if (mode != interlace)
+            std::fill(halfTileHash.begin(), halfTileHash.end(), unknownHash);
+        interlace = mode;
+    }
+
+    // Worst case for one encode of a cols x rows grid, for callers that
+    // bring their own buffer.
+    static size_t maxEncodedSize(int cols, int rows)
+    {
+        return maxBytesPerCell * size_t(std::max(cols, 0)) * size_t(std::max(rows, 0)) + slackBytes;
+    }
+
+    // Cells the last encode rewrote, flat runs included.
+    size_t changedCells() const
+    {
+        return cellsWritten;
+    }
+
+    // Escapes are written straight into the string's storage through a
+    // pointer, sized for the worst case so no write needs a capacity check,
+    // then trimmed to what was actually written.
+    void encode(const screen& pixels, const cellGrid& textCells, int cols, int rows,
+                std::string& out)
+    {
+        size_t base = out.size();
+        out.resize_and_overwrite(base + maxEncodedSize(cols, rows),
+                                 [&](char* buf, size_t)
+                                 {
+                                     return size_t(encode(pixels, textCells, cols, rows, buf + base) - buf);
+                                 });
+    }
+
+    // Encodes into out, which needs room for maxEncodedSize(cols, rows), and
+    // returns the end of what was written.
+    //
+    // Frames are hashed per tile of tileW cells (and per row from those)
+    // before anything else, so unchanged rows and tiles cost one compare and
+    // an unchanged frame produces no output at all.
+    char* encode(const screen& pixels, const cellGrid& textCells, int cols, int rows, char* out)
+    {
+        CLON_ZONE("encode");
+        char* p = out;
+        cellsWritten = 0;
+        tilesX = (cols + tileW - 1) / tileW;
+        if (cols != shownW || rows != shownH || shown.empty())
+        {
+            shownW = cols;
+            shownH = rows;
+            shown.assign(size_t(cols) * rows, unknownCell);
+            shownTileHash.assign(size_t(tilesX) * rows, unknownHash);
+            halfTileHash.assign(size_t(tilesX) * rows, unknownHash);
+            putLiteral(p, "\x1b[0m\x1b[?25l\x1b[2J");
+            sgrKnown = false;
+            cursorKnown = false;
+        }
+        if (cols <= 0 || rows <= 0)
+            return p;
+
+        targetTileHash.resize(shownTileHash.size());
+        bool changed = false;
+        for (int y = 0; y < rows; ++y)
+        {
+            for (int t = 0; t < tilesX; ++t)
+            {
+                int x = t * tileW;
+                int n = std::min(tileW, cols - x);
+                std::uint64_t h = hashBytes(pixels[y * 2].data() + x, n * sizeof(Pixel), 0);
+                h = hashBytes(pixels[y * 2 + 1].data() + x, n * sizeof(Pixel), h);
+                h = hashBytes(textCells.data() + y * cellsW + x, n * sizeof(TextCell), h);
+                h |= 1;
+                targetTileHash[size_t(y) * tilesX + t] = h;
+                changed |= h != shownTileHash[size_t(y) * tilesX + t];
+            }
+        }
+        if (changed)
+            encodeChanges(pixels, textCells, p);
+        return p;
+    }
+
+private:
+    // Upper bounds on bytes written: per changed cell (CUP + a two-colour SGR
+    // + glyph is at most 50), plus the reset, scroll sequences and store
+    // overhang.
+    static constexpr size_t maxBytesPerCell = 64;
+    static constexpr size_t slackBytes = 128;
+
+    // Below this many cells a flat run is cheaper as plain half blocks.
+    static constexpr int minFillRun = 4;
+
+    // Longest scroll we look for, in cell rows.
+    static constexpr int maxScroll = 32;
+
+    static constexpr int tileW = 16;
+
+    // Zero-filled slots are valid: black is (0, 0, 0) in OKLab too.
+    static constexpr int labCacheBits = 12;
+    std::array<std::pair<Pixel, Oklab>, 1 << labCacheBits> labCache{};
+
+    // Tile hashes are forced odd, so 0 marks a tile whose on-screen content
+    // is not known to match any frame.
+    static constexpr std::uint64_t unknownHash = 0;
+
+    // A cell whose content is unknown (after a clear, a resize or a scroll)
+    // never equals a target cell, nor counts as similar to one.
+    static constexpr CellState unknownCell{0, 0, 0, false};
+
+    TerminalCaps caps;
+    ColorQuality quality;
+    Pixel quantMask = 0xFFFFFF;
+    std::array<std::uint8_t, 256> quantLevels{};
+    int maxChannelError = 0;
+    bool palette256 = false;
+    Interlace interlace = Interlace::Off;
+    int parity = 0;
+    std::vector<CellState> shown;
+    std::vector<CellState> target;
+    struct DirtyTile
+    {
+        int y;
+        int t;
+        int score;
+    };
+    std::vector<DirtyTile> dirtyTiles;
+    size_t byteBudget = 0;
+    Rect focus{};
+    std::vector<std::uint64_t> shownTileHash;
+    std::vector<std::uint64_t> targetTileHash;
+    // Checkerboard only: the target one half of a tile was last brought to,
+    // with the low bit holding which half.
+    std::vector<std::uint64_t> halfTileHash;
+    std::vector<std::uint64_t> shownRowHash;
+    std::vector<std::uint64_t> targetRowHash;
+    int shownW = 0;
+    int shownH = 0;
+    int tilesX = 0;
+    size_t cellsWritten = 0;
+
+    bool sgrKnown = false;
+    Pixel sgrBg = 0;
+    Pixel sgrFg = 0;
+
+    bool cursorKnown = false;
+    int cursorX = 0;
+    int cursorY = 0;
+
+    // Colour mapping changed, so cells settled under the old mapping have to
+    // be compared again; what is on screen stays valid.
+    void recheckAll()
+    {
+        std::fill(shownTileHash.begin(), shownTileHash.end(), unknownHash);
+        std::fill(halfTileHash.begin(), halfTileHash.end(), unknownHash);
+    }
+
+    // Whether row y is updated this frame at all, and the first cell at or
+    // after x that is.
+    bool rowInPass(int y) const
+    {
+        return interlace != Interlace::Rows || ((y + parity) & 1) == 0;
+    }
+
+    int passStart(int y, int x) const
+    {
+        return interlace == Interlace::Checkerboard ? x + ((x + y + parity) & 1) : x;
+    }
+
+    // A tile whose cells of this pass were brought to the target. With a
+    // checkerboard that is only half of it, so the tile is unknown until the
+    // other half has been brought to the same target.
+    void settleTile(size_t i)
+    {
+        std::uint64_t other = (targetTileHash[i] & ~std::uint64_t(1)) | (parity ^ 1);
+        if (interlace == Interlace::Checkerboard && halfTileHash[i] != other)
+        {
+            halfTileHash[i] = other ^ 1;
+            shownTileHash[i] = unknownHash;
+        }
+        else
+        {
+            shownTileHash[i] = targetTileHash[i];
+        }
+    }
+
+    // Checkerboard only: one half of tile i is already exact for its target.
+    bool halfPending(size_t i) const
+    {
+        return interlace == Interlace::Checkerboard && halfTileHash[i] != unknownHash &&
+            (halfTileHash[i] | 1) == targetTileHash[i];
+    }
+
+    void encodeChanges(const screen& pixels, const cellGrid& textCells, char*& p)
+    {
+        char* start = p;
+        scrollIfShifted(p);
+
+        target.resize(shown.size());
+        halfTileHash.resize(shownTileHash.size(), unknownHash);
+        if (byteBudget == 0)
+        {
+            for (int y = 0; y < shownH; ++y)
+            {
+                const std::uint64_t* want = targetTileHash.data() + size_t(y) * tilesX;
+                std::uint64_t* have = shownTileHash.data() + size_t(y) * tilesX;
+                if (!rowInPass(y) || std::equal(want, want + tilesX, have))
+                    continue;
+
+                buildRow(pixels, textCells, y);
+                int done = 0;
+                for (int t = 0; t < tilesX; ++t)
+                {
+                    if (want[t] == have[t])
+                        continue;
+                    int from = passStart(y, std::max(done, t * tileW));
+                    int to = std::min(shownW, (t + 1) * tileW);
+                    done = diffCells(y, from, to, p);
+                    settleTile(size_t(y) * tilesX + t);
+                }
+            }
+        }
+        else
+        {
+            encodeWithinBudget(pixels, textCells, start, p);
+        }
+
+        if (interlace != Interlace::Off)
+            parity ^= 1;
+    }
+
+    // Budgeted encode. If the changed cells look like they fit, this is the
+    // plain row-major diff. Otherwise tiles go out in priority order (focus
+    // region first, then the most changed) until most of the budget is
+    // spent, the rest of the dirty tiles get a flat fill of their average
+    // colour if the terminal can fill cheaply, and whatever was not written
+    // exactly keeps its tile dirty so later frames refine it.
+    void encodeWithinBudget(const screen& pixels, const cellGrid& textCells, char* start, char*& p)
+    {
+        dirtyTiles.clear();
+        size_t changedCells = 0;
+        for (int y = 0; y < shownH; ++y)
+        {
+            const std::uint64_t* want = targetTileHash.data() + size_t(y) * tilesX;
+            std::uint64_t* have = shownTileHash.data() + size_t(y) * tilesX;
+            if (!rowInPass(y) || std::equal(want, want + tilesX, have))
+                continue;
+
+            buildRow(pixels, textCells, y);
+            const CellState* next = target.data() + size_t(y) * shownW;
+            const CellState* row = shown.data() + size_t(y) * shownW;
+            for (int t = 0; t < tilesX; ++t)
+            {
+                if (want[t] == have[t])
+                    continue;
+                int count = 0;
+                for (int x = passStart(y, t * tileW); x < std::min(shownW, (t + 1) * tileW); x += cellStep())
+                    count += !(next[x] == row[x]);
+                if (count == 0)
+                {
+                    settleTile(size_t(y) * tilesX + t);
+                    continue;
+                }
+
+                bool focused = focus.w > 0 && y >= focus.y && y < focus.y + focus.h &&
+                    (t + 1) * tileW > focus.x && t * tileW < focus.x + focus.w;
+                dirtyTiles.push_back({y, t, count + (focused ? tileW + 1 : 0)});
+                changedCells += count;
+            }
+        }
+
+        // Rough cost of a changed cell: an SGR for most cells plus a glyph.
+        bool fits = changedCells * 24 <= byteBudget;
+        if (!fits)
+        {
+            std::stable_sort(dirtyTiles.begin(), dirtyTiles.end(),
+                             [](const DirtyTile& a, const DirtyTile& b) { return a.score > b.score; });
+        }
+
+        bool canFill = caps.rep || caps.bce;
+        size_t exactBudget = fits || !canFill ? byteBudget : byteBudget * 3 / 4;
+        size_t i = 0;
+        for (; i < dirtyTiles.size() && size_t(p - start) < exactBudget; ++i)
+        {
+            auto [y, t, score] = dirtyTiles[i];
+            diffCells(y, passStart(y, t * tileW), std::min(shownW, (t + 1) * tileW), p);
+            settleTile(size_t(y) * tilesX + t);
+        }
+
+        for (; canFill && i < dirtyTiles.size() && size_t(p - start) < byteBudget; ++i)
+        {
+            auto [y, t, score] = dirtyTiles[i];
+            // A fill would undo the half of a checkerboard tile that is
+            // already exact, and the halves would never line up.
+            if (halfPending(size_t(y) * tilesX + t))
+                continue;
+            int from = t * tileW;
+            int to = std::min(shownW, from + tileW);
+            const CellState* next = target.data() + size_t(y) * shownW;
+
+            unsigned sum[3] = {};
+            for (int x = from; x < to; ++x)
+                for (int c = 0; c < 3; ++c)
+                    sum[c] += ((next[x].bg >> (16 - 8 * c)) & 0xFF) + ((next[x].fg >> (16 - 8 * c)) & 0xFF);
+            unsigned n = 2 * (to - from);
+            Pixel avg = quantize(Pixel(sum[0] / n) << 16 | Pixel(sum[1] / n) << 8 | Pixel(sum[2] / n));
+
+            moveTo(from, y, p);
+            emitFill(avg, to - from, to == shownW, p);
+            std::fill(shown.begin() + size_t(y) * shownW + from, shown.begin() + size_t(y) * shownW + to,
+                      CellState{avg, avg, 0});
+            shownTileHash[size_t(y) * tilesX + t] = unknownHash;
+            halfTileHash[size_t(y) * tilesX + t] = unknownHash;
+        }
+    }
+
+    void buildRow(const screen& pixels, const cellGrid& textCells, int y)
+    {
+        const Pixel* upper = pixels[y * 2].data();
+        const Pixel* lower = pixels[y * 2 + 1].data();
+        const TextCell* text = textCells.data() + y * cellsW;
+        CellState* out = target.data() + size_t(y) * shownW;
+        for (int x = 0; x < shownW; ++x)
+        {
+            out[x] = text[x].ch
+                               ? CellState{quantize(text[x].bg), quantize(text[x].fg), text[x].ch}
+                               : CellState{quantize(upper[x]), quantize(lower[x]), 0};
+        }
+    }
+
+    // Drops the low bits of each channel and refills them by repeating the
+    // kept high bits, so white stays white at any depth.
+    Pixel quantize(Pixel c) const
+    {
+        c &= 0xFFFFFF;
+        if (quantMask != 0xFFFFFF)
+        {
+            c = Pixel(quantLevels[c >> 16]) << 16 | Pixel(quantLevels[(c >> 8) & 0xFF]) << 8 |
+                quantLevels[c & 0xFF];
+        }
+        return palette256 ? xtermColor(xtermIndex(c)) : c;
+    }
+
+    bool similar(Pixel a, Pixel b)
+    {
+        if (a == b)
+            return true;
+        if (quality.maxDeltaE <= 0)
+            return false;
+        // OKLab barely sees a dark channel next to a bright one (red 0..80
+        // beside full green), so also keep each channel within two steps.
+        for (int shift = 0; shift < 24; shift += 8)
+        {
+            if (std::abs(int((a >> shift) & 0xFF) - int((b >> shift) & 0xFF)) > maxChannelError)
+                return false;
+        }
+        Oklab x = lab(a);
+        Oklab y = lab(b);
+        float dl = x.l - y.l, da = x.a - y.a, db = x.b - y.b;
+        return dl * dl + da * da + db * db <= quality.maxDeltaE * quality.maxDeltaE;
+    }
+
+    bool similar(const CellState& a, const CellState& b)
+    {
+        return a.known && b.known && a.ch == b.ch && similar(a.bg, b.bg) && similar(a.fg, b.fg);
+    }
+
+    // OKLab needs three cube roots; a small direct-mapped cache keeps that
+    // off the per-cell path for the handful of colours a frame tends to use.
+    Oklab lab(Pixel c)
+    {
+        auto& slot = labCache[(c * 2654435761u) >> (32 - labCacheBits)];
+        if (slot.first != c)
+            slot = {c, toOklab(c)};
+        return slot.second;
+    }
+
+    int cellStep() const
+    {
+        return interlace == Interlace::Checkerboard ? 2 : 1;
+    }
+
+    // Brings the cells of this pass in [from, to) of row y up to its target;
+    // `from` has to be one of them. A flat run may carry on past `to` and
+    // over cells of the other pass; returns the first cell not yet handled.
+    int diffCells(int y, int from, int to, char*& p)
+    {
+        const CellState* next = target.data() + size_t(y) * shownW;
+        CellState* row = shown.data() + size_t(y) * shownW;
+        int step = cellStep();
+        int x = from;
+        for (; x < to; x += step)
+        {
+            if (next[x] == row[x] || similar(next[x], row[x]))
+                continue;
+
+            if (next[x].ch == 0 && next[x].bg == next[x].fg && (caps.bce || caps.rep))
+            {
+                int end = x + 1;
+                while (end < shownW && next[end].ch == 0 && next[end].bg == next[end].fg &&
+                    similar(next[end].bg, next[x].bg))
+                    ++end;
+                if (end - x >= minFillRun)
+                {
+                    moveTo(x, y, p);
+                    emitFill(next[x].bg, end - x, end == shownW, p);
+                    std::fill(row + x, row + end, next[x]);
+                    // Land on the last cell of this pass before `end`.
+                    x = end - step + ((end - x) & (step - 1));
+                    continue;
+                }
+            }
+
+            moveTo(x, y, p);
+            row[x] = emitCell(next[x], p);
+        }
+        return x;
+    }
+
+    // Row hashes for scroll detection, folded from the tile hashes. A shown
+    // row with any unknown tile can't be the source of a scroll.
+    void hashRows()
+    {
+        int rows = shownH;
+        shownRowHash.resize(rows);
+        targetRowHash.resize(rows);
+        size_t bytes = size_t(tilesX) * sizeof(std::uint64_t);
+        for (int y = 0; y < rows; ++y)
+        {
+            const std::uint64_t* have = shownTileHash.data() + size_t(y) * tilesX;
+            targetRowHash[y] = hashBytes(targetTileHash.data() + size_t(y) * tilesX, bytes, 0);
+            bool known = std::find(have, have + tilesX, unknownHash) == have + tilesX;
+            shownRowHash[y] = known ? hashBytes(have, bytes, 0) : unknownHash;
+        }
+    }
+
+    // Looks for a band of rows that moved up or down by the same amount
+    // since the last frame (log views, waterfalls) and, if one exists,
+    // scrolls it inside a DECSTBM region so only the exposed rows are left
+    // for the diff. The shift is detected on cell rows, i.e. content has to
+    // move by an even number of pixel rows.
+    void scrollIfShifted(char*& p)
+    {
+        int rows = shownH;
+        int cols = shownW;
+        hashRows();
+        const auto& shownHash = shownRowHash;
+        const auto& targetHash = targetRowHash;
+
+        // A band [a, b] of target rows that equals shown rows [a + k, b + k];
+        // k > 0 means the content moved up. Gain counts the rows in the band
+        // that would otherwise have to be redrawn.
+        int bestK = 0, bestA = 0, bestB = 0, bestGain = 0;
+        for (int k = -std::min(maxScroll, rows - 1); k <= std::min(maxScroll, rows - 1); ++k)
+        {
+            if (k == 0)
+                continue;
+            int first = std::max(0, -k);
+            int last = std::min(rows, rows - k);
+            for (int y = first; y < last;)
+            {
+                if (targetHash[y] != shownHash[y + k])
+                {
+                    ++y;
+                    continue;
+                }
+                int a = y, gain = 0;
+                for (; y < last && targetHash[y] == shownHash[y + k]; ++y)
+                    gain += targetHash[y] != shownHash[y];
+                if (gain > bestGain)
+                {
+                    bestK = k;
+                    bestA = a;
+                    bestB = y - 1;
+                    bestGain = gain;
+                }
+            }
+        }
+
+        // Scrolling costs about as much as redrawing a couple of cells.
+        if (bestGain < 2)
+            return;
+
+        int k = std::abs(bestK);
+        int top = bestK > 0 ? bestA : bestA - k;
+        int bottom = bestK > 0 ? bestB + k : bestB;
+
+        putLiteral(p, "\x1b[");
+        putField(p, top + 1);
+        putDecimal(p, bottom + 1);
+        *p++ = 'r';
+        putRelative(p, k, bestK > 0 ? 'S' : 'T');
+        putLiteral(p, "\x1b[r");
+        cursorKnown = false;
+
+        // Mirror the scroll in shown and the tile hashes; the exposed rows
+        // hold whatever the terminal erased them to, so mark them unknown.
+        auto shift = [&](auto& grid, int width, auto unknown)
+        {
+            auto rowAt = [&](int y) { return grid.begin() + ptrdiff_t(y) * width; };
+            if (bestK > 0)
+            {
+                std::copy(rowAt(top + k), rowAt(bottom + 1), rowAt(top));
+                std::fill(rowAt(bottom + 1 - k), rowAt(bottom + 1), unknown);
+            }
+            else
+            {
+                std::copy_backward(rowAt(top), rowAt(bottom + 1 - k), rowAt(bottom + 1));
+                std::fill(rowAt(top), rowAt(top + k), unknown);
+            }
+        };
+        shift(shown, cols, unknownCell);
+        shift(shownTileHash, tilesX, unknownHash);
+        shift(halfTileHash, tilesX, unknownHash);
+    }
+
+    // One SGR setting the background, the foreground or both; each colour
+    // field is written with its ';', and the last ';' becomes the 'm'.
+    void putSgr(char*& p, const Pixel* bg, const Pixel* fg) const
+    {
+        putLiteral(p, "\x1b[");
+        for (auto [intro, c] : {std::pair{"48;2;", bg}, std::pair{"38;2;", fg}})
+        {
+            if (!c)
+                continue;
+            std::memcpy(p, intro, 6);
+            if (palette256)
+            {
+                p[3] = '5';
+                p += 5;
+                putField(p, xtermIndex(*c));
+                continue;
+            }
+            p += 5;
+            putField(p, (*c >> 16) & 0xFF);
+            putField(p, (*c >> 8) & 0xFF);
+            putField(p, *c & 0xFF);
+        }
+        p[-1] = 'm';
+    }
+
+    // "\x1b[nC" style sequence, with n omitted when it is 1.
+    static int relativeCost(int n)
+    {
+        return n == 1 ? 3 : 3 + decimalDigits(n);
+    }
+
+    static void putRelative(char*& p, int n, char final)
+    {
+        putLiteral(p, "\x1b[");
+        if (n != 1)
+            putDecimal(p, n);
+        *p++ = final;
+    }
+
+    // Bytes needed to rewrite cells [from, to) of row y as they already are,
+    // or -1 if that would need an SGR change.
+    int reemitCost(int y, int from, int to) const
+    {
+        if (!sgrKnown || to - from > 4)
+            return -1;
+        int cost = 0;
+        for (int x = from; x < to; ++x)
+        {
+            const CellState& c = shown[size_t(y) * shownW + x];
+            if (c.bg != sgrBg || c.fg != sgrFg)
+                return -1;
+            cost += glyphBytes(c.ch);
+        }
+        return cost;
+    }
+
+    void moveTo(int x, int y, char*& p)
+    {
+        if (cursorKnown && cursorX == x && cursorY == y)
+            return;
+
+        enum class Move { Absolute, Forward, Back, Reemit, NewLine };
+        Move best = Move::Absolute;
+        int bestCost = 3 + decimalDigits(y + 1) + (x ? 1 + decimalDigits(x + 1) : 0);
+
+        auto consider = [&](Move m, int cost)
+        {
+            if (cost >= 0 && cost < bestCost)
+            {
+                best = m;
+                bestCost = cost;
+            }
+        };
+
+        if (cursorKnown && cursorY == y && x > cursorX)
+        {
+            consider(Move::Forward, relativeCost(x - cursorX));
+            consider(Move::Reemit, reemitCost(y, cursorX, x));
+        }
+        else if (cursorKnown && cursorY == y)
+            consider(Move::Back, relativeCost(cursorX - x));
+        else if (cursorKnown && y > cursorY && y - cursorY <= 3)
+            consider(Move::NewLine, 1 + (y - cursorY) + (x ? relativeCost(x) : 0));
+
+        switch (best)
+        {
+        case Move::Absolute:
+            putLiteral(p, "\x1b[");
+            if (x)
+            {
+                putField(p, y + 1);
+                putDecimal(p, x + 1);
+            }
+            else
+                putDecimal(p, y + 1);
+            *p++ = 'H';
+            break;
+        case Move::Forward: putRelative(p, x - cursorX, 'C');
+            break;
+        case Move::Back: putRelative(p, cursorX - x, 'D');
+            break;
+        case Move::Reemit:
+            for (int cx = cursorX; cx < x; ++cx)
+                putGlyph(p, shown[size_t(y) * shownW + cx].ch);
+            break;
+        case Move::NewLine:
+            *p++ = '\r';
+            for (int n = y - cursorY; n > 0; --n)
+                *p++ = '\n';
+            if (x)
+                putRelative(p, x, 'C');
+            break;
+        }
+        cursorKnown = true;
+        cursorX = x;
+        cursorY = y;
+    }
+
+    static void putGlyph(char*& p, char32_t ch)
+    {
+        if (ch)
+            putUtf8(p, ch);
+        else
+            putLiteral(p, "▄");
+    }
+
+    // Paints n cells from the cursor in a flat colour with a single
+    // background SGR. A flat half block looks the same as a blank, so the
+    // run is drawn as spaces: one space plus REP, or an erase (EL to the end
+    // of the line, ECH otherwise) on terminals with background colour erase.
+    void emitFill(Pixel color, int n, bool toEndOfLine, char*& p)
+    {
+        // fg is unknown at first, so pin it to something; a flat cell
+        // ignores it.
+        if (!sgrKnown)
+            putSgr(p, &color, &color);
+        else if (color != sgrBg)
+            putSgr(p, &color, nullptr);
+        if (!sgrKnown)
+            sgrFg = color;
+        sgrKnown = true;
+        sgrBg = color;
+        cellsWritten += n;
+
+        if (caps.rep)
+        {
+            *p++ = ' ';
+            if (n > 1)
+                putRelative(p, n - 1, 'b');
+            cursorX += n;
+            if (cursorX >= shownW)
+                cursorKnown = false;
+        }
+        else if (toEndOfLine)
+            putLiteral(p, "\x1b[K");
+        else
+            putRelative(p, n, 'X');
+    }
+
+    // Returns what the cell shows, which under a perceptual quality setting
+    // may be the current SGR colours rather than the requested ones.
+    CellState emitCell(CellState c, char*& p)
+    {
+        if (sgrKnown && quality.maxDeltaE > 0)
+        {
+            if (similar(c.bg, sgrBg))
+                c.bg = sgrBg;
+            if (similar(c.fg, sgrFg))
+                c.fg = sgrFg;
+        }
+
+        bool setBg = !sgrKnown || c.bg != sgrBg;
+        bool setFg = !sgrKnown || c.fg != sgrFg;
+        if (setBg || setFg)
+            putSgr(p, setBg ? &c.bg : nullptr, setFg ? &c.fg : nullptr);
+        sgrKnown = true;
+        sgrBg = c.bg;
+        sgrFg = c.fg;
+
+        putGlyph(p, c.ch);
+        ++cellsWritten;
+
+        // Writing the last column leaves the cursor in the pending-wrap
+        // state, which terminals disagree on, so forget where it is.
+        if (++cursorX >= shownW)
+            cursorKnown = false;
+        return c;
+    }
+};
+
+// One rung of the bandwidth ladder: a colour quality preset, the palette,
+// the interlacing and the share of the nominal frame rate to run at.
+struct AdaptiveLevel
+{
+    int quality;
+    bool palette256;
+    Interlace interlace;
+    int fpsPercent;
+};
+
+inline constexpr AdaptiveLevel adaptiveLevels[] = {
+    {0, false, Interlace::Off, 100},
+    {1, false, Interlace::Off, 100},
+    {2, false, Interlace::Off, 100},
+    {3, false, Interlace::Off, 100},
+    {3, true, Interlace::Off, 100},
+    {4, true, Interlace::Rows, 100},
+    {4, true, Interlace::Rows, 75},
+    {4, true, Interlace::Rows, 50},
+    {4, true, Interlace::Rows, 33},
+};
+
+// Watches how large frames are and how long writing them blocks, and walks
+// down adaptiveLevels while the output can't keep up (e.g. ssh to another
+// datacenter), back up once it has kept up for a while. A local terminal
+// absorbs writes immediately and stays at full quality.
+class BandwidthGovernor
+{
+public:
+    void setEnabled(bool on)
+    {
+        enabled = on;
+        if (!on)
+            current = 0;
+    }
+
+    bool isEnabled() const
+    {
+        return enabled;
+    }
+
+    // 0 disables the fixed budget; the measured throughput still applies.
+    void setByteBudget(size_t bytes)
+    {
+        byteBudget = bytes;
+    }
+
+    void setFrameRate(int fps)
+    {
+        baseFps = std::max(1, fps);
+    }
+
+    const AdaptiveLevel& level() const
+    {
+        return adaptiveLevels[current];
+    }
+
+    int levelIndex() const
+    {
+        return current;
+    }
+
+    int frameRate() const
+    {
+        return std::max(1, baseFps * level().fpsPercent / 100);
+    }
+
+    // Output rate estimated from writes that blocked, in bytes per second;
+    // 0 until a write has blocked long enough to measure.
+    double throughput() const
+    {
+        return rate;
+    }
+
+    // Bytes a frame may use: the fixed budget, tightened to what the
+    // measured throughput can drain in one frame period. 0 means unlimited.
+    size_t frameBudget() const
+    {
+        size_t budget = byteBudget;
+        if (rate > 0)
+        {
+            auto drainable = size_t(rate * 0.8 / frameRate());
+            budget = budget ? std::min(budget, drainable) : drainable;
+        }
+        return budget;
+    }
+
+    void recordWrite(size_t bytes, std::chrono::nanoseconds took)
+    {
+        double secs = std::chrono::duration<double>(took).count();
+        double period = 1.0 / frameRate();
+
+        // Short writes only measure memcpy into the kernel buffer.
+        if (secs > 0.001)
+        {
+            double sample = bytes / secs;
+            rate = rate > 0 ? rate * 0.8 + sample * 0.2 : sample;
+        }
+        else if (rate > 0 && secs < period * 0.05)
+        {
+            // The link has room: let the estimate recover, and forget it
+            // once it no longer limits anything.
+            rate *= 1.05;
+            if (rate > 1e9)
+                rate = 0;
+        }
+
+        if (!enabled)
+            return;
+
+        size_t budget = frameBudget();
+        bool congested = secs > period * 0.5 || (budget && bytes > budget);
+        bool idle = secs < period * 0.1 && (!budget || bytes < budget / 2);
+
+        calm = idle ? calm + 1 : 0;
+        strained = congested ? strained + 1 : 0;
+
+        if (strained >= stepDownAfter && current + 1 < int(std::size(adaptiveLevels)))
+        {
+            ++current;
+            strained = 0;
+        }
+        else if (calm >= stepUpAfter && current > 0)
+        {
+            --current;
+            calm = 0;
+        }
+    }
+
+private:
+    // Frames of sustained pressure or calm before changing level; stepping
+    // up is slow so the level doesn't oscillate around the link's capacity.
+    static constexpr int stepDownAfter = 3;
+    static constexpr int stepUpAfter = 60;
+
+    bool enabled = true;
+    size_t byteBudget = 0;
+    int baseFps = 15;
+    int current = 0;
+    int strained = 0;
+    int calm = 0;
+    double rate = 0;
+};
+
+// Log-linear buckets in the style of HdrHistogram: values below 16 are kept
+// exactly, larger ones in one of 16 buckets per power of two, so any value is
+// reported within 1/16 of what was recorded, from nanoseconds to minutes.
+class Histogram
+{
+public:
+    void record(std::uint64_t v)
+    {
+        ++counts[bucketOf(v)];
+        ++total;
+        sum += v;
+        peak = std::max(peak, v);
+    }
+
+    std::uint64_t count() const
+    {
+        return total;
+    }
+
+    std::uint64_t max() const
+    {
+        return peak;
+    }
+
+    double mean() const
+    {
+        return total ? double(sum) / total : 0;
+    }
+
+    // The value at or below which p percent (0-100) of the records lie.
+    std::uint64_t percentile(double p) const
+    {
+        auto wanted = std::uint64_t(std::ceil(std::clamp(p, 0.0, 100.0) / 100 * total));
+        std::uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            seen += counts[i];
+            if (seen >= std::max<std::uint64_t>(wanted, 1))
+                return std::min(upperBound(i), peak);
+        }
+        return peak;
+    }
+
+    void reset()
+    {
+        counts.fill(0);
+        total = 0;
+        sum = 0;
+        peak = 0;
+    }
+
+private:
+    static constexpr int subBits = 4;
+    static constexpr int subBuckets = 1 << subBits;
+
+    std::array<std::uint64_t, subBuckets * (65 - subBits)> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t sum = 0;
+    std::uint64_t peak = 0;
+
+    static size_t bucketOf(std::uint64_t v)
+    {
+        if (v < subBuckets)
+            return size_t(v);
+        int shift = std::bit_width(v) - 1 - subBits;
+        return size_t(subBuckets * (shift + 1) + (v >> shift) - subBuckets);
+    }
+
+    static std::uint64_t upperBound(size_t i)
+    {
+        if (i < subBuckets)
+            return i;
+        int shift = int(i / subBuckets) - 1;
+        std::uint64_t top = subBuckets + i % subBuckets;
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+enum class PerfEvent
+{
+    Cycles,
+    Instructions,
+    CacheMisses,
+    BranchMisses,
+};
+
+inline constexpr int perfEventCount = 4;
+
+struct PerfSample
+{
+    std::array<std::uint64_t, perfEventCount> counts{};
+
+    std::uint64_t operator[](PerfEvent e) const
+    {
+        return counts[int(e)];
+    }
+
+    PerfSample& operator+=(const PerfSample& o)
+    {
+        for (int i = 0; i < perfEventCount; ++i)
+            counts[i] += o.counts[i];
+        return *this;
+    }
+
+    PerfSample operator-(const PerfSample& o) const
+    {
+        PerfSample d;
+        for (int i = 0; i < perfEventCount; ++i)
+            d.counts[i] = counts[i] - o.counts[i];
+        return d;
+    }
+};
+
+// Hardware counters of the calling thread, opened as one perf_event group so
+// they count over exactly the same instructions and are read with a single
+// syscall. Containers often refuse perf_event_open (EACCES under seccomp or
+// a strict perf_event_paranoid, ENOENT or EOPNOTSUPP without a virtual PMU):
+// open() then returns false with errno set, and reads come back as zeros.
+// Events the CPU lacks are left out of the group and read as zero too.
+class PerfCounters
+{
+public:
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters()
+    {
+        close();
+    }
+
+    bool open()
+    {
+        close();
+#ifdef CLON_PERF
+        static constexpr std::uint64_t configs[perfEventCount] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (int i = 0; i < perfEventCount; ++i)
+        {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[i];
+            attr.disabled = i == 0;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID |
+                PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = int(syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0));
+            if (fds[i] < 0 && i == 0)
+                return false;
+            if (fds[i] >= 0)
+                ioctl(fds[i], PERF_EVENT_IOC_ID, &ids[i]);
+        }
+        ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        return true;
+#else
+        errno = ENOSYS;
+        return false;
+#endif
+    }
+
+    void close()
+    {
+#ifdef CLON_PERF
+        for (int& fd : fds)
+        {
+            if (fd >= 0)
+                ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+
+    bool isOpen() const
+    {
+        return fds[0] >= 0;
+    }
+
+    bool has(PerfEvent e) const
+    {
+        return fds[int(e)] >= 0;
+    }
+
+    // Counts since open, scaled up if the kernel had to multiplex the group
+    // with other users of the counters.
+    PerfSample read() const
+    {
+        PerfSample s;
+#ifdef CLON_PERF
+        struct
+        {
+            std::uint64_t nr;
+            std::uint64_t enabled;
+            std::uint64_t running;
+            struct
+            {
+                std::uint64_t value;
+                std::uint64_t id;
+            } values[perfEventCount];
+        } data{};
+        if (!isOpen() || ::read(fds[0], &data, sizeof(data)) <= 0 || data.running == 0)
+            return s;
+        double scale = double(data.enabled) / data.running;
+        for (std::uint64_t v = 0; v < std::min<std::uint64_t>(data.nr, perfEventCount); ++v)
+        {
+            for (int i = 0; i < perfEventCount; ++i)
+            {
+                if (fds[i] >= 0 && ids[i] == data.values[v].id)
+                    s.counts[i] = std::uint64_t(data.values[v].value * scale);
+            }
+        }
+#endif
+        return s;
+    }
+
+private:
+    int fds[perfEventCount] = {-1, -1, -1, -1};
+    std::uint64_t ids[perfEventCount] = {};
+};
+
+enum class FrameStage
+{
+    Input,
+    Draw,
+    Encode,
+    Write,
+};
+
+inline constexpr int frameStageCount = 4;
+
+inline const char* stageName(FrameStage s)
+{
+    static const char* const names[frameStageCount] = {"input", "draw", "encode", "write"};
+    return names[int(s)];
+}
+
+// What one presented frame cost.
+struct FrameStats
+{
+    std::chrono::nanoseconds stage[frameStageCount]{};
+    PerfSample counters[frameStageCount]; // zero without hardware counters
+    size_t bytes = 0;
+    size_t cells = 0;
+    size_t writes = 0;
+};
+
+// Splits frame time into stages with marks: each mark charges the time since
+// the previous one to its stage, so a stage can be charged several times a
+// frame (waiting for an output buffer and committing both count as writing).
+// Time between endFrame and the next beginFrame, i.e. the frame limiter's
+// sleep, isn't charged anywhere.
+class FrameProfiler
+{
+public:
+    // Also splits cycles, instructions, cache and branch misses of the
+    // calling thread by stage where perf_event_open is permitted. Returns
+    // false (errno set) if it isn't, and timing carries on without them.
+    bool setHardwareCounters(bool on)
+    {
+        if (!on)
+        {
+            counters.close();
+            return true;
+        }
+        return counters.isOpen() || counters.open();
+    }
+
+    const PerfCounters& hardwareCounters() const { return counters; }
+
+    void beginFrame()
+    {
+        current = {};
+        if (counters.isOpen())
+            lastCount = counters.read();
+        last = std::chrono::steady_clock::now();
+    }
+
+    void mark(FrameStage s)
+    {
+        auto now = std::chrono::steady_clock::now();
+        current.stage[int(s)] += now - last;
+        last = now;
+        if (counters.isOpen())
+        {
+            PerfSample count = counters.read();
+            current.counters[int(s)] += count - lastCount;
+            lastCount = count;
+        }
+    }
+
+    void addOutput(size_t bytes, size_t cells, size_t writes)
+    {
+        current.bytes += bytes;
+        current.cells += cells;
+        current.writes += writes;
+    }
+
+    void endFrame()
+    {
+        for (int i = 0; i < frameStageCount; ++i)
+        {
+            stages[i].record(current.stage[i].count());
+            counterTotals[i] += current.counters[i];
+        }
+        byteCounts.record(current.bytes);
+        cellCounts.record(current.cells);
+        writeCounts.record(current.writes);
+        previous = current;
+    }
+
+    // The last frame completed.
+    const FrameStats& lastFrame() const { return previous; }
+
+    // Stage latencies in nanoseconds.
+    const Histogram& latency(FrameStage s) const { return stages[int(s)]; }
+
+    const Histogram& bytesPerFrame() const { return byteCounts; }
+    const Histogram& cellsPerFrame() const { return cellCounts; }
+    const Histogram& writesPerFrame() const { return writeCounts; }
+
+    // Hardware counts of a stage summed over all frames since reset.
+    const PerfSample& counterTotal(FrameStage s) const { return counterTotals[int(s)]; }
+
+    std::uint64_t frames() const
+    {
+        return byteCounts.count();
+    }
+
+    void reset()
+    {
+        for (auto& h : stages)
+            h.reset();
+        byteCounts.reset();
+        cellCounts.reset();
+        writeCounts.reset();
+        for (auto& t : counterTotals)
+            t = {};
+        previous = {};
+    }
+
+    // One line per stage with its median, 99th percentile and worst case in
+    // microseconds, then the output per frame. With hardware counters, a
+    // line per stage with its mean cycles, instructions per cycle, cache
+    // misses (cm) and branch misses (bm) per frame follows.
+    std::string summary() const
+    {
+        std::string out;
+        char line[96];
+        for (int i = 0; i < frameStageCount; ++i)
+        {
+            const Histogram& h = stages[i];
+            std::snprintf(line, sizeof(line), "%-6s p50 %6.0f p99 %6.0f max %6.0f us\n",
+                          stageName(FrameStage(i)), h.percentile(50) / 1e3,
+                          h.percentile(99) / 1e3, h.max() / 1e3);
+            out += line;
+        }
+        std::snprintf(line, sizeof(line), "%.0f B %.0f cells %.1f writes/frame\n",
+                      byteCounts.mean(), cellCounts.mean(), writeCounts.mean());
+        out += line;
+        if (!counters.isOpen() || frames() == 0)
+            return out;
+
+        double n = double(frames()) * 1e3;
+        for (int i = 0; i < frameStageCount; ++i)
+        {
+            const PerfSample& t = counterTotals[i];
+            double cycles = double(t[PerfEvent::Cycles]);
+            std::snprintf(line, sizeof(line), "%-6s %6.0fk cyc %4.2f ipc %5.1fk cm %5.1fk bm\n",
+                          stageName(FrameStage(i)), cycles / n,
+                          cycles ? t[PerfEvent::Instructions] / cycles : 0.0,
+                          t[PerfEvent::CacheMisses] / n, t[PerfEvent::BranchMisses] / n);
+            out += line;
+        }
+        return out;
+    }
+
+private:
+    Histogram stages[frameStageCount];
+    Histogram byteCounts;
+    Histogram cellCounts;
+    Histogram writeCounts;
+    PerfSample counterTotals[frameStageCount];
+    PerfCounters counters;
+    PerfSample lastCount;
+    FrameStats current;
+    FrameStats previous;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+};
+
+class Window
+{
+public:
+    Window()
+        : cells(cellsW * cellsH)
+    {
+        clear({0, 0, 0});
+#ifndef _WIN32
+        encoder.setCaps(detectTerminalCaps());
+#endif
+    }
+
+#ifndef _WIN32
+    // Fixes the colour quality and turns bandwidth adaptation off.
+    void setColorQuality(ColorQuality q)
+    {
+        governor.setEnabled(false);
+        appliedLevel = -1;
+        encoder.setQuality(q);
+        encoder.setPalette256(false);
+        encoder.setInterlace(Interlace::Off);
+    }
+
+    // Fixes the interlacing and turns bandwidth adaptation off.
+    void setInterlace(Interlace mode)
+    {
+        governor.setEnabled(false);
+        appliedLevel = -1;
+        encoder.setInterlace(mode);
+    }
+
+    BandwidthGovernor& bandwidth() { return governor; }
+
+    // Where frames are written: add recording sinks or switch to io_uring.
+    FrameOutput& frameOutput() { return output; }
+
+    // Asciicast and raw framebuffer recordings of presented frames.
+    FrameRecorder& recording() { return recorder; }
+
+    // Pixels in r are refined first when a frame doesn't fit the budget.
+    void setFocus(Rect r)
+    {
+        int top = std::max(0, r.y) / 2;
+        int bottom = (std::max(0, r.y + r.h) + 1) / 2;
+        encoder.setFocus({r.x, top, r.w, bottom - top});
+    }
+#endif
+
+    // Headless windows encode frames but never touch the terminal.
+    void setHeadless(bool on)
+    {
+        headless = on;
+    }
+
+    // Encode for a terminal of this size instead of asking the real one
+    // (0 to ask again), e.g. the size recorded in an input log.
+    void setTerminalSize(int cols, int rows)
+    {
+        fixedCols = cols;
+        fixedRows = rows;
+    }
+
+    // Frame timings and output counts, see FrameProfiler. The main loop
+    // marks the input stage itself; present() marks the rest.
+    FrameProfiler& profiler() { return profile; }
+
+    // Draws the profiler's numbers over the top-left corner of each
+    // presented frame. The pixels underneath are put back afterwards, so the
+    // overlay doesn't disturb later drawing or contentHash().
+    void setProfilerHud(bool on)
+    {
+        hud = on;
+    }
+
+    // Hash of everything present() would show: pixels and text cells.
+    std::uint64_t contentHash() const
+    {
+        std::uint64_t h = hashBytes(buffer.data(), sizeof(buffer), 0);
+        return hashBytes(cells.data(), cells.size() * sizeof(TextCell), h);
+    }
+
+    // The rate the main loop should present at; lower than the nominal
+    // rate while the output is congested.
+    int frameRate() const
+    {
+#ifdef _WIN32
+        return 15;
+#else
+        return governor.frameRate();
+#endif
+    }
+
+    void clear(Color c)
+    {
+        Pixel v = compactColor(c);
+        for (auto& row : buffer)
+            row.fill(v);
+    }
+
+    void drawPixel(int x, int y, Color c)
+    {
+        if (x < 0 || y < 0 || x >= screenW || y >= screenH)
+            return;
+        buffer[y][x] = compactColor(c);
+    }
+
+    void drawLine(int x0, int y0, int x1, int y1, Color c)
+    {
+        int dx = abs(x1 - x0);
+        int dy = abs(y1 - y0);
+        int steps = std::max(dx, dy);
+
+        if (steps == 0)
+        {
+            drawPixel(x0, y0, c);
+            return;
+        }
+
+        Pixel packed = compactColor(c);
+
+        for (int i = 0; i <= steps; ++i)
+        {
+            float t = static_cast<float>(i) / steps;
+            int x = static_cast<int>(x0 + t * (x1 - x0));
+            int y = static_cast<int>(y0 + t * (y1 - y0));
+
+            if (x >= 0 && y >= 0 && x < screenW && y < screenH)
+                buffer[y][x] = packed;
+        }
+    }
+
+    void blit(const Surface& src, Rect srcRect, int dstX, int dstY)
+    {
+        blitRows(src, srcRect, dstX, dstY, copySpan);
+    }
+
+    // Skips source pixels matching key, for sprites without an alpha channel.
+    void blitKeyed(const Surface& src, Rect srcRect, int dstX, int dstY, Color key)
+    {
+        Pixel k = compactColor(key);
+        blitRows(src, srcRect, dstX, dstY, [k](Pixel* d, const Pixel* s, int n)
+        {
+            keySpan(d, s, n, k);
+        });
+    }
+
+    void blitAlpha(const Surface& src, Rect srcRect, int dstX, int dstY)
+    {
+        blitRows(src, srcRect, dstX, dstY, alphaSpan);
+    }
+
+    // Puts a terminal-native character over the pixels of cell (col, row);
+    // each cell covers pixels (col, 2 * row) and (col, 2 * row + 1).
+    void setCell(int col, int row, char32_t ch, Color fg, Color bg)
+    {
+        if (col < 0 || row < 0 || col >= cellsW || row >= cellsH)
+            return;
+        if (ch && (ch < 0x20 || ch == 0x7F))
+            ch = U' ';
+        cells[row * cellsW + col] = {ch, compactColor(fg), compactColor(bg)};
+    }
+
+    // Writes UTF-8 text into consecutive cells. Returns the column after it.
+    int putText(int col, int row, std::string_view text, Color fg, Color bg)
+    {
+        for (size_t i = 0; i < text.size();)
+            setCell(col++, row, decodeUtf8(text, i), fg, bg);
+        return col;
+    }
+
+    void clearCell(int col, int row)
+    {
+        if (col < 0 || row < 0 || col >= cellsW || row >= cellsH)
+            return;
+        cells[row * cellsW + col] = {};
+    }
+
+    // Cells are reset whole, not just ch, so cleared cells hash the same as
+    // ones that never held text.
+    void clearCells()
+    {
+        std::fill(cells.begin(), cells.end(), TextCell{});
+    }
+
+    // Draws UTF-8 text with its top-left corner at (x, y). '\n' starts a new
+    // line at x. Returns the x just past the last glyph drawn.
+    int drawText(int x, int y, std::string_view text, Color c,
+                 const BitmapFont& font = BitmapFont::builtin())
+    {
+        Pixel color = compactColor(c);
+        Pixel key = color ^ 0x00FFFFFF;
+        Rect cell{0, 0, font.width(), font.height()};
+        int penX = x;
+
+        for (size_t i = 0; i < text.size();)
+        {
+            char32_t cp = decodeUtf8(text, i);
+            if (cp == U'\n')
+            {
+                penX = x;
+                y += font.height();
+                continue;
+            }
+
+            const Surface& g = font.glyph(font.glyphIndex(cp), color);
+            blitRows(g, cell, penX, y, [key](Pixel* d, const Pixel* s, int n)
+            {
+                keySpan(d, s, n, key);
+            });
+            penX += font.width();
+        }
+        return penX;
+    }
+
+    // src must hold premultiplied pixels, see premultiplySurface.
+    void composite(const Surface& src, Rect srcRect, int dstX, int dstY,
+                   BlendMode mode = BlendMode::Over, bool gammaCorrect = false)
+    {
+        blitRows(src, srcRect, dstX, dstY, [=](Pixel* d, const Pixel* s, int n)
+        {
+            compositeSpan(d, s, n, mode, gammaCorrect);
+        });
+    }
+
+    // Blends a flat, possibly translucent colour over r, e.g. a HUD panel.
+    void blendRect(Rect r, Color c, BlendMode mode = BlendMode::Over, bool gammaCorrect = false)
+    {
+        int x = r.x;
+        int y = r.y;
+        Rect src{0, 0, r.w, r.h};
+        if (!clipBlit(src, x, y, r.w, r.h, screenW, screenH))
+            return;
+        std::vector<Pixel> span(src.w, premultiplyColor(c));
+        for (int row = 0; row < src.h; ++row)
+            compositeSpan(buffer[y + row].data() + x, span.data(), src.w, mode, gammaCorrect);
+    }
+
+    // Once a layer exists its dirty regions are rebuilt from the stack's
+    // background on present, replacing anything drawn there directly.
+    LayerStack& layers() { return layerStack; }
+
+    void present()
+    {
+        CLON_ZONE("present");
+        layerStack.composite(buffer);
+        Rect covered = hud ? drawHud() : Rect{};
+        profile.mark(FrameStage::Draw);
+        drawBuffer(buffer, cells);
+        for (int y = 0; y < covered.h; ++y)
+            copySpan(buffer[y].data(), hudBackup.data() + y * covered.w, covered.w);
+        profile.endFrame();
+    }
+
+private:
+    screen buffer{};
+    cellGrid cells;
+    LayerStack layerStack;
+    bool headless = false;
+    int fixedCols = 0;
+    int fixedRows = 0;
+    FrameProfiler profile;
+    bool hud = false;
+    std::vector<Pixel> hudBackup;
+#ifndef _WIN32
+    TerminalEncoder encoder;
+    BandwidthGovernor governor;
+    int appliedLevel = 0;
+    FrameOutput output;
+    FrameRecorder recorder;
+#endif
+
+    // Returns the area drawn over, from the top-left corner, whose pixels
+    // were saved to hudBackup first.
+    Rect drawHud()
+    {
+        std::string text = profile.summary();
+        const BitmapFont& font = BitmapFont::builtin();
+        int lines = 0;
+        size_t widest = 0;
+        for (size_t from = 0, nl; (nl = text.find('\n', from)) != std::string::npos; from = nl + 1)
+        {
+            widest = std::max(widest, nl - from);
+            ++lines;
+        }
+
+        Rect r{0, 0, std::min(screenW, int(widest) * font.width() + 4),
+               std::min(screenH, lines * font.height() + 4)};
+        hudBackup.resize(size_t(r.w) * r.h);
+        for (int y = 0; y < r.h; ++y)
+            copySpan(hudBackup.data() + y * r.w, buffer[y].data(), r.w);
+
+        blendRect(r, {0, 0, 0, 176});
+        drawText(2, 2, text, {255, 255, 255}, font);
+        return r;
+    }
+
+    template <typename Span>
+    void blitRows(const Surface& src, Rect r, int dstX, int dstY, Span span)
+    {
+        if (!clipBlit(r, dstX, dstY, src.width(), src.height(), screenW, screenH))
+            return;
+        for (int y = 0; y < r.h; ++y)
+            span(buffer[dstY + y].data() + dstX, src.row(r.y + y) + r.x, r.w);
+    }
+
+    void drawBuffer(const screen& pixelBuff, const cellGrid& textCells)
     {
 #ifdef _WIN32
+        if (headless)
+            return;
         static HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
         CONSOLE_SCREEN_BUFFER_INFO csbi;
         GetConsoleScreenBufferInfo(hConsole, &csbi);
@@ -287,8 +4973,8 @@ private:
 
         int h = pixelBuff.size() & ~1;
         int w = pixelBuff[0].size();
-        int cellH = min(h / 2, maxH);
-        int cellW = min(w, maxW);
+        int cellH = std::min(h / 2, maxH);
+        int cellW = std::min(w, maxW);
 
         static std::vector<CHAR_INFO> buf(cellW * cellH);
 
@@ -296,91 +4982,392 @@ private:
         {
             for (int x = 0; x < cellW; ++x)
             {
+                const TextCell& text = textCells[y * cellsW + x];
+                Pixel upper = text.ch ? text.bg : pixelBuff[y * 2][x];
+                Pixel lower = text.ch ? text.fg : pixelBuff[y * 2 + 1][x];
+
                 int ur, ug, ub, lr, lg, lb;
-                unpackColor(pixelBuff[y * 2][x], ur, ug, ub);
-                unpackColor(pixelBuff[y * 2 + 1][x], lr, lg, lb);
+                unpackColor(upper, ur, ug, ub);
+                unpackColor(lower, lr, lg, lb);
 
                 auto& cell = buf[y * cellW + x];
-                cell.Char.UnicodeChar = L'\u2584';
+                cell.Char.UnicodeChar = text.ch && text.ch < 0x10000 ? WCHAR(text.ch) : L'\u2584';
                 cell.Attributes =
                     rgbToWinAttr(lr, lg, lb) |
                     (rgbToWinAttr(ur, ug, ub) << 4);
             }
         }
 
+        profile.mark(FrameStage::Encode);
+
         COORD size{(SHORT)cellW, (SHORT)cellH};
         COORD zero{0, 0};
         SMALL_RECT rect{0, 0, (SHORT)(cellW - 1), (SHORT)(cellH - 1)};
         WriteConsoleOutputW(hConsole, buf.data(), size, zero, &rect);
+        profile.addOutput(0, size_t(cellW) * cellH, 1);
+        profile.mark(FrameStage::Write);
 #else
-        write(STDOUT_FILENO, "\x1b[H\x1b[J", 6);
+        int termW = fixedCols;
+        int termH = fixedRows;
+        if ((termW <= 0 || termH <= 0) && !getTerminalSize(termW, termH))
+        {
+            termW = cellsW;
+            termH = cellsH;
+        }
+
+        int cols = std::min(cellsW, termW);
+        int rows = std::min(cellsH, termH);
+
+        if (headless)
+        {
+            encoder.setByteBudget(0);
+            char* frame = output.begin(TerminalEncoder::maxEncodedSize(cols, rows));
+            char* end = encoder.encode(pixelBuff, textCells, cols, rows, frame);
+            profile.mark(FrameStage::Encode);
+            profile.addOutput(end - frame, encoder.changedCells(), 0);
+            if (end != frame && recorder.isRecording())
+                recorder.submit({frame, size_t(end - frame)}, pixelBuff);
+            profile.mark(FrameStage::Write);
+            return;
+        }
+
+        const AdaptiveLevel& level = governor.level();
+        if (governor.isEnabled() && governor.levelIndex() != appliedLevel)
+        {
+            encoder.setQuality(qualityLevels[level.quality]);
+            encoder.setPalette256(level.palette256);
+            encoder.setInterlace(level.interlace);
+            appliedLevel = governor.levelIndex();
+        }
+
+        // Time spent waiting for the output counts as writing, whether that
+        // is a blocking write or waiting for a free async buffer.
+        encoder.setByteBudget(governor.frameBudget());
+        std::uint64_t writes = output.writeCount();
+        auto start = std::chrono::steady_clock::now();
+        char* frame = output.begin(TerminalEncoder::maxEncodedSize(cols, rows));
+        auto waited = std::chrono::steady_clock::now() - start;
+        profile.mark(FrameStage::Write);
+        char* end = encoder.encode(pixelBuff, textCells, cols, rows, frame);
+        profile.mark(FrameStage::Encode);
+        if (end == frame)
+            return;
+
+        start = std::chrono::steady_clock::now();
+        output.commit(end);
+        governor.recordWrite(end - frame, waited + (std::chrono::steady_clock::now() - start));
+        if (recorder.isRecording())
+            recorder.submit({frame, size_t(end - frame)}, pixelBuff);
+        profile.addOutput(end - frame, encoder.changedCells(), output.writeCount() - writes);
+        profile.mark(FrameStage::Write);
+#endif
+    }
+};
+
+#ifdef CLON_BENCH
+
+// Hardware counters for the benchmarks, when the kernel lets us have them.
+PerfCounters benchCounters;
+
+// Runs fn (which returns the bytes it produced) for about a quarter of a
+// second and reports the mean time per call and the output rate, plus what
+// the hardware counters saw per call.
+template <typename Fn>
+void bench(const char* name, Fn fn)
+{
+    using clock = std::chrono::steady_clock;
+    fn();
+
+    size_t bytes = 0;
+    int iters = 0;
+    PerfSample before = benchCounters.read();
+    auto start = clock::now();
+    auto elapsed = clock::duration{};
+    do
+    {
+        bytes += fn();
+        ++iters;
+        elapsed = clock::now() - start;
+    }
+    while (elapsed < std::chrono::milliseconds(250));
+    PerfSample counted = benchCounters.read() - before;
+
+    double secs = std::chrono::duration<double>(elapsed).count();
+    std::printf("%-28s %10.1f us/iter %9.1f KB/iter %9.1f MB/s\n", name,
+                secs / iters * 1e6, bytes / 1024.0 / iters, bytes / secs / 1e6);
+    if (!benchCounters.isOpen())
+        return;
+    double cycles = double(counted[PerfEvent::Cycles]);
+    std::printf("%-28s %10.0f cyc/iter %8.2f ipc %9.0f cache-miss %9.0f branch-miss\n", "",
+                cycles / iters, cycles ? counted[PerfEvent::Instructions] / cycles : 0.0,
+                double(counted[PerfEvent::CacheMisses]) / iters,
+                double(counted[PerfEvent::BranchMisses]) / iters);
+}
+
+int runBenchmarks()
+{
+    if (!benchCounters.open())
+        std::printf("hardware counters unavailable: %s\n", std::strerror(errno));
+
+    std::mt19937 rng(42);
+    static screen frames[2];
+    for (auto& frame : frames)
+        for (auto& row : frame)
+            for (auto& p : row)
+                p = rng() | 0xFF000000;
 
-        int termW, termH;
-        getTerminalSize(termW, termH);
+    cellGrid cells(cellsW * cellsH);
+    TerminalEncoder encoder;
+    encoder.setCaps({true, true});
+    std::string out;
+    int which = 0;
 
-        size_t cellH = std::min(pixelBuff.size() / 2, size_t(termH));
-        size_t cellW = std::min(pixelBuff[0].size(), size_t(termW));
+    auto encode = [&](const screen& frame)
+    {
+        out.clear();
+        encoder.encode(frame, cells, cellsW, cellsH, out);
+        return out.size();
+    };
 
-        std::string frame;
-        frame.reserve(cellH * cellW * 12);
+    bench("encode/every-cell-changed", [&] { return encode(frames[which ^= 1]); });
+    bench("encode/unchanged", [&] { return encode(frames[which]); });
+    bench("encode/scattered-1pct", [&]
+    {
+        for (int i = 0; i < screenW * screenH / 100; ++i)
+            frames[which][rng() % screenH][rng() % screenW] = rng() | 0xFF000000;
+        return encode(frames[which]);
+    });
 
-        auto appendInt = [&](int v)
+#ifndef _WIN32
+    // Full frames into a pipe drained by another thread, as when piping into
+    // a recorder: copied by write, then handed over with vmsplice.
+    int fds[2];
+    if (pipe(fds) != 0)
+        return 1;
+    std::thread reader([fd = fds[0]]
+    {
+        std::vector<char> sink(1 << 20);
+        while (read(fd, sink.data(), sink.size()) > 0)
         {
-            if (v >= 100)
-            {
-                frame.push_back('0' + v / 100);
-                frame.push_back('0' + (v / 10) % 10);
-                frame.push_back('0' + v % 10);
-            }
-            else if (v >= 10)
-            {
-                frame.push_back('0' + v / 10);
-                frame.push_back('0' + v % 10);
-            }
-            else
-                frame.push_back('0' + v);
-        };
+        }
+    });
+    // Then asynchronously through io_uring, and with a recording file as a
+    // second sink, which blocking writes would serialise behind the pipe.
+    enum class Mode
+    {
+        Write,
+        Splice,
+        Uring,
+        WriteAndFile,
+        UringAndFile,
+    };
+    const std::pair<Mode, const char*> modes[] = {
+        {Mode::Write, "output/pipe-write"},
+        {Mode::Splice, "output/pipe-vmsplice"},
+        {Mode::Uring, "output/pipe-uring"},
+        {Mode::WriteAndFile, "output/pipe+file-write"},
+        {Mode::UringAndFile, "output/pipe+file-uring"},
+    };
+    for (auto [mode, name] : modes)
+    {
+        FrameOutput output(fds[1]);
+        if (mode != Mode::Splice)
+            output.disableZeroCopy();
+        else if (!output.zeroCopy())
+            continue;
+        if ((mode == Mode::Uring || mode == Mode::UringAndFile) && !output.setAsync(true))
+            continue;
+        FILE* file = nullptr;
+        if (mode == Mode::WriteAndFile || mode == Mode::UringAndFile)
+        {
+            file = std::tmpfile();
+            output.addSink(fileno(file));
+        }
 
-        for (size_t y = 0; y < cellH; ++y)
+        bench(name, [&]
         {
-            for (size_t x = 0; x < cellW; ++x)
-            {
-                int ur, ug, ub, lr, lg, lb;
-                unpackColor(pixelBuff[y * 2][x], ur, ug, ub);
-                unpackColor(pixelBuff[y * 2 + 1][x], lr, lg, lb);
+            char* frame = output.begin(TerminalEncoder::maxEncodedSize(cellsW, cellsH));
+            char* end = encoder.encode(frames[which ^= 1], cells, cellsW, cellsH, frame);
+            output.commit(end);
+            return size_t(end - frame);
+        });
+        output.flush();
+        if (file)
+            std::fclose(file);
+    }
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+#endif
+    return 0;
+}
+
+int main()
+{
+    return runBenchmarks();
+}
+
+#elif defined(CLON_TEST)
 
-                frame.append("\x1b[48;2;");
-                appendInt(ur);
-                frame.push_back(';');
-                appendInt(ug);
-                frame.push_back(';');
-                appendInt(ub);
-                frame.push_back('m');
+// Regression checks run by ctest.
 
-                frame.append("\x1b[38;2;");
-                appendInt(lr);
-                frame.push_back(';');
-                appendInt(lg); frame.push_back(';');
-                appendInt(lb);
-                frame.push_back('m');
+// A near-white frame at every quality level has to be painted whole on the
+// first encode, after invalidate() and after a resize: cells not drawn yet
+// used to read as white and count as similar to these colours.
+bool lossyQualityPaintsEveryCell()
+{
+    static screen frame;
+    for (int y = 0; y < screenH; ++y)
+        for (int x = 0; x < screenW; ++x)
+            frame[y][x] = 0xFFFCFCFC + ((x + y) & 3) * 0x010101;
 
-                frame.append("▄");
+    cellGrid cells(cellsW * cellsH);
+    TerminalEncoder encoder;
+    // Without fills every cell is drawn, and counted, on its own.
+    encoder.setCaps({false, false});
+    std::string out;
+    for (const ColorQuality& q : qualityLevels)
+    {
+        encoder.setQuality(q);
+        encoder.invalidate();
+        for (auto [cols, rows] : {std::pair{cellsW, cellsH}, std::pair{cellsW / 2, cellsH / 3}})
+        {
+            out.clear();
+            encoder.encode(frame, cells, cols, rows, out);
+            if (encoder.changedCells() != size_t(cols) * rows)
+            {
+                std::fprintf(stderr, "quality %d/%.2f %dx%d: painted %zu of %d cells\n", q.bits,
+                             q.maxDeltaE, cols, rows, encoder.changedCells(), cols * rows);
+                return false;
             }
-            frame.append("\x1b[0m\n");
         }
-        write(STDOUT_FILENO, frame.data(), frame.size());
-#endif
     }
-};
+    return true;
+}
 
 int main()
 {
+    bool ok = lossyQualityPaintsEveryCell();
+    return ok ? 0 : 1;
+}
+
+#else
+
+// --record FILE logs input and resizes while running; --replay FILE plays
+// such a log back instead of reading input, and with --headless does so
+// without a terminal and as fast as possible. A replay ends with the log and
+// reports whether its frames matched the recorded ones. --cast FILE and
+// --raw FILE record the frames themselves. --hud overlays frame timings and
+// --profile prints them on exit. --trace FILE writes a Chrome trace of the
+// frames on exit and whenever SIGUSR1 arrives (CLON_TRACE builds only).
+// --counters adds hardware counters per stage to --hud and --profile.
+int main(int argc, char** argv)
+{
+    const char* recordPath = nullptr;
+    const char* replayPath = nullptr;
+    const char* castPath = nullptr;
+    const char* rawPath = nullptr;
+    const char* tracePath = nullptr;
+    bool headless = false;
+    bool hud = false;
+    bool profile = false;
+    bool counters = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--record" && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (arg == "--replay" && i + 1 < argc)
+            replayPath = argv[++i];
+        else if (arg == "--headless")
+            headless = true;
+        else if (arg == "--cast" && i + 1 < argc)
+            castPath = argv[++i];
+        else if (arg == "--raw" && i + 1 < argc)
+            rawPath = argv[++i];
+        else if (arg == "--hud")
+            hud = true;
+        else if (arg == "--profile")
+            profile = true;
+        else if (arg == "--counters")
+            counters = true;
+        else if (arg == "--trace" && i + 1 < argc)
+            tracePath = argv[++i];
+    }
+
+    InputReplay replay;
+    if (replayPath && !replay.open(replayPath))
+    {
+        std::fprintf(stderr, "can't replay %s\n", replayPath);
+        return 1;
+    }
+    InputRecorder recorder;
+    if (recordPath && !recorder.open(recordPath))
+    {
+        std::fprintf(stderr, "can't record to %s\n", recordPath);
+        return 1;
+    }
+    headless = headless && replayPath;
+    virtualClock = headless;
+
+#ifdef CLON_TRACE
+    if (tracePath)
+    {
+        traceEnabled = true;
+        CLON_THREAD_NAME("main");
+#ifndef _WIN32
+        signal(SIGUSR1, [](int) { traceDumpRequested = true; });
+#endif
+    }
+#else
+    if (tracePath)
+        std::fprintf(stderr, "tracing needs a build with CLON_TRACE\n");
+#endif
+
+    if (!headless)
+    {
+#ifndef _WIN32
+        atexit(restoreTerminal);
+#endif
+        enableRawInput();
 #ifndef _WIN32
-    atexit(restoreTerminal);
+        if (!replayPath)
+        {
+            enableMouse(false);
+            enableKittyKeyboard();
+        }
 #endif
-    enableRawInput();
+    }
 
+    std::optional<InputThread> input;
+    if (!replayPath)
+        input.emplace();
+    KeyboardState keyboard;
     Window window;
+    window.setHeadless(headless);
+    window.setProfilerHud(hud);
+    if (counters && !window.profiler().setHardwareCounters(true))
+        std::fprintf(stderr, "hardware counters unavailable: %s\n", std::strerror(errno));
+#ifndef _WIN32
+    // Replayed frames have to come out the same, so no adapting to the
+    // output on the way.
+    if (replayPath)
+        window.bandwidth().setEnabled(false);
+
+    int castW = cellsW;
+    int castH = cellsH;
+    if (!replayPath && getTerminalSize(castW, castH))
+    {
+        castW = std::min(castW, cellsW);
+        castH = std::min(castH, cellsH);
+    }
+    if ((castPath && !window.recording().openCast(castPath, castW, castH)) ||
+        (rawPath && !window.recording().openRaw(rawPath)))
+    {
+        std::fprintf(stderr, "can't record frames\n");
+        return 1;
+    }
+#endif
 
     window.drawPixel(0, 0, {255, 0, 0});
     window.drawPixel(2, 2, {0, 255, 0});
@@ -389,37 +5376,85 @@ int main()
     bool running = true;
     int termW = 0;
     int termH = 0;
+    int penX = 40;
+    int penY = 20;
+    std::uint32_t frame = 0;
+    std::uint64_t digest = 0;
 
-    while (running)
+    for (; running; ++frame)
     {
+#ifdef CLON_TRACE
+        if (traceDumpRequested.exchange(false) && !writeTrace(tracePath))
+            std::fprintf(stderr, "can't write trace to %s\n", tracePath);
+#endif
+
         // input
-        for (auto keys = pollInput(); auto& k : keys)
+        CLON_ZONE("frame", frame);
+        window.profiler().beginFrame();
+        auto nextEvent = [&](InputEvent& e) { return input ? input->next(e) : replay.next(frame, e); };
+        for (InputEvent e; nextEvent(e);)
         {
-            if (!std::holds_alternative<char>(k) &&
-                std::get<KeyType>(k) == KeyType::Escape)
-            {
+            if (recorder.isOpen())
+                recorder.record(frame, e);
+            keyboard.apply(e.key);
+            if (isKeyPress(e.key, KeyType::Escape))
                 running = false;
-            }
+            if (auto* m = std::get_if<MouseEvent>(&e.key); m && m->button == MouseButton::Left &&
+                (m->action == MouseAction::Press || m->action == MouseAction::Drag))
+                window.drawPixel(m->x, m->y, {255, 255, 255});
         }
+        if (replayPath && replay.finished(frame))
+            break;
+        window.profiler().mark(FrameStage::Input);
+
+        // held arrows move a pen (only terminals reporting releases)
+        penX += keyboard.isHeld(KeyType::Right) - keyboard.isHeld(KeyType::Left);
+        penY += keyboard.isHeld(KeyType::Down) - keyboard.isHeld(KeyType::Up);
+        window.drawPixel(penX, penY, {0, 255, 255});
 
         // terminal size guard
-        if (!getTerminalSize(termW, termH))
+        int oldW = termW;
+        int oldH = termH;
+        bool sized = replayPath ? replay.size(termW, termH) : getTerminalSize(termW, termH);
+        if (recorder.isOpen() && sized && (termW != oldW || termH != oldH))
+            recorder.recordResize(frame, termW, termH);
+        if (!sized)
         {
             limitFPS(15);
             continue;
         }
 
-        if (termW < 300 || termH < 150)
+        if (termW < screenW || termH < screenH / 2)
         {
             limitFPS(15);
             continue;
         }
 
         // render
+        window.setTerminalSize(termW, termH);
         window.present();
-        limitFPS(15);
+        digest = hashBytes(&digest, sizeof(digest), window.contentHash());
+        limitFPS(window.frameRate());
     }
 
+    if (recorder.isOpen())
+        recorder.finish(frame, digest);
+#ifdef CLON_TRACE
+    if (tracePath && !writeTrace(tracePath))
+        std::fprintf(stderr, "can't write trace to %s\n", tracePath);
+#endif
+    if (profile)
+        std::fprintf(stderr, "%llu frames\n%s", (unsigned long long)window.profiler().frames(),
+                     window.profiler().summary().c_str());
+    if (replayPath)
+    {
+        auto recorded = replay.digest();
+        bool same = recorded && *recorded == digest;
+        std::fprintf(stderr, "replayed %u frames: %s\n", frame,
+                     !recorded ? "no recorded digest" : same ? "frames match" : "frames differ");
+        return recorded && !same ? 2 : 0;
+    }
     return 0;
 }
 
+#endif